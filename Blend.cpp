@@ -0,0 +1,282 @@
+#include "Blend.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BLEND_X86
+#include <immintrin.h>
+#endif
+
+// exact floor(x / 255) for x <= 65025, i.e. any product of two bytes
+static inline uint32_t div255(uint32_t x) {
+    return (x + 1 + (x >> 8)) >> 8;
+}
+
+// RGBA over opaque RGB:
+//   alpha >= 253 copies the (tinted) source, like the float path's > .99 check
+//   otherwise out = floor((src * alpha + dst * (255 - alpha)) / 255)
+static void blendRGBAOverRGBScalar(const uint8_t* src, uint8_t* dst, int count, uint8_t r, uint8_t g, uint8_t b) {
+    const uint8_t tint[3] = {r, g, b};
+    for (int i = 0; i < count; i++, src += 4, dst += 3) {
+        uint32_t alpha = src[3] >= 253 ? 255 : src[3];
+        for (int channel = 0; channel < 3; channel++) {
+            uint32_t tinted = div255(src[channel] * tint[channel]);
+            dst[channel] = div255(tinted * alpha + dst[channel] * (255 - alpha));
+        }
+    }
+}
+
+// RGBA over RGBA, scaled by 255 so everything stays integer up to the final division:
+//   both alphas >= 253 copies the (tinted) source
+//   outAlpha = srcAlpha * 255 + dstAlpha * (255 - srcAlpha), fully transparent below .01
+//   out = (src * srcAlpha * 255 + dst * dstAlpha * (255 - srcAlpha)) / outAlpha, divided in float
+//   (both operands are exact in a float, so the vector kernels get the very same result)
+static void blendRGBAOverRGBAScalar(const uint8_t* src, uint8_t* dst, int count, uint8_t r, uint8_t g, uint8_t b) {
+    const uint8_t tint[3] = {r, g, b};
+    for (int i = 0; i < count; i++, src += 4, dst += 4) {
+        uint32_t srcAlpha = src[3];
+        uint32_t dstAlpha = dst[3];
+        uint32_t tinted[3];
+        for (int channel = 0; channel < 3; channel++) {
+            tinted[channel] = div255(src[channel] * tint[channel]);
+        }
+
+        if (srcAlpha >= 253 && dstAlpha >= 253) {
+            for (int channel = 0; channel < 3; channel++) {
+                dst[channel] = tinted[channel];
+            }
+            dst[3] = srcAlpha;
+            continue;
+        }
+
+        uint32_t outAlpha = srcAlpha * 255 + dstAlpha * (255 - srcAlpha);
+        if (outAlpha <= 650) {
+            dst[0] = dst[1] = dst[2] = dst[3] = 0;
+            continue;
+        }
+        for (int channel = 0; channel < 3; channel++) {
+            uint32_t num = tinted[channel] * srcAlpha * 255 + dst[channel] * dstAlpha * (255 - srcAlpha);
+            dst[channel] = (uint8_t)((float)num / (float)outAlpha);
+        }
+        dst[3] = div255(outAlpha);
+    }
+}
+
+#ifdef BLEND_X86
+
+static inline void storeBytes4(uint8_t* dst, __m128i value) {
+    int32_t bytes = _mm_cvtsi128_si32(value);
+    memcpy(dst, &bytes, 4);
+}
+
+// exact floor(x / 255) on every 16 bit lane
+__attribute__((target("sse2")))
+static inline __m128i div255x8(__m128i x) {
+    return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(x, _mm_set1_epi16(1)), _mm_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i div255x16(__m256i x) {
+    return _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(x, _mm256_set1_epi16(1)), _mm256_srli_epi16(x, 8)), 8);
+}
+
+// two RGBA source pixels over two RGBx destination pixels, all widened to 16 bit lanes
+__attribute__((target("sse2")))
+static inline __m128i blendOverRGB(__m128i s, __m128i d, __m128i tint) {
+    const __m128i full = _mm_set1_epi16(255);
+    s = div255x8(_mm_mullo_epi16(s, tint));
+    __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    alpha = _mm_or_si128(alpha, _mm_and_si128(_mm_cmpgt_epi16(alpha, _mm_set1_epi16(252)), full));
+    return div255x8(_mm_add_epi16(_mm_mullo_epi16(s, alpha), _mm_mullo_epi16(d, _mm_sub_epi16(full, alpha))));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i blendOverRGB(__m256i s, __m256i d, __m256i tint) {
+    const __m256i full = _mm256_set1_epi16(255);
+    s = div255x16(_mm256_mullo_epi16(s, tint));
+    __m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    alpha = _mm256_or_si256(alpha, _mm256_and_si256(_mm256_cmpgt_epi16(alpha, _mm256_set1_epi16(252)), full));
+    return div255x16(_mm256_add_epi16(_mm256_mullo_epi16(s, alpha), _mm256_mullo_epi16(d, _mm256_sub_epi16(full, alpha))));
+}
+
+// 4 pixels per iteration, pshufb spreads the packed RGB destination out to RGBx and back
+__attribute__((target("ssse3")))
+static void blendRGBAOverRGBSSSE3(const uint8_t* src, uint8_t* dst, int count, uint8_t r, uint8_t g, uint8_t b) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i tint = _mm_setr_epi16(r, g, b, 255, r, g, b, 255);
+    const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i gather = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+    int i = 0;
+    // the destination load reads 16 bytes for 12, stay clear of the end of the row
+    for (; i + 6 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i*4));
+        __m128i d = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(dst + i*3)), spread);
+        __m128i lo = blendOverRGB(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero), tint);
+        __m128i hi = blendOverRGB(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero), tint);
+        __m128i out = _mm_shuffle_epi8(_mm_packus_epi16(lo, hi), gather);
+        _mm_storel_epi64((__m128i*)(dst + i*3), out);
+        storeBytes4(dst + i*3 + 8, _mm_srli_si128(out, 8));
+    }
+    blendRGBAOverRGBScalar(src + i*4, dst + i*3, count - i, r, g, b);
+}
+
+// same as the SSSE3 kernel with 8 pixels per iteration, 4 in each 128 bit lane
+__attribute__((target("avx2")))
+static void blendRGBAOverRGBAVX2(const uint8_t* src, uint8_t* dst, int count, uint8_t r, uint8_t g, uint8_t b) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i tint = _mm256_setr_epi16(r, g, b, 255, r, g, b, 255, r, g, b, 255, r, g, b, 255);
+    const __m256i spread = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                            0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m256i gather = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                            0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+    int i = 0;
+    for (; i + 10 <= count; i += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i*4));
+        __m256i d = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(dst + i*3))),
+                                            _mm_loadu_si128((const __m128i*)(dst + i*3 + 12)), 1);
+        d = _mm256_shuffle_epi8(d, spread);
+        __m256i lo = blendOverRGB(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero), tint);
+        __m256i hi = blendOverRGB(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero), tint);
+        __m256i out = _mm256_shuffle_epi8(_mm256_packus_epi16(lo, hi), gather);
+        __m128i outLo = _mm256_castsi256_si128(out);
+        __m128i outHi = _mm256_extracti128_si256(out, 1);
+        _mm_storel_epi64((__m128i*)(dst + i*3), outLo);
+        storeBytes4(dst + i*3 + 8, _mm_srli_si128(outLo, 8));
+        _mm_storel_epi64((__m128i*)(dst + i*3 + 12), outHi);
+        storeBytes4(dst + i*3 + 20, _mm_srli_si128(outHi, 8));
+    }
+    blendRGBAOverRGBScalar(src + i*4, dst + i*3, count - i, r, g, b);
+}
+
+// one tinted RGBA source pixel over one RGBA destination pixel (low 4 lanes of each), channels in the float lanes
+__attribute__((target("sse2")))
+static inline __m128i blendOverRGBA(__m128i s16, __m128i d16) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 full = _mm_set1_ps(255.f);
+    const __m128 opaque = _mm_set1_ps(252.f);
+    const __m128 alphaLane = _mm_castsi128_ps(_mm_setr_epi32(0, 0, 0, -1));
+
+    __m128i s32 = _mm_unpacklo_epi16(s16, zero);
+    __m128 s = _mm_cvtepi32_ps(s32);
+    __m128 d = _mm_cvtepi32_ps(_mm_unpacklo_epi16(d16, zero));
+    __m128 srcAlpha = _mm_shuffle_ps(s, s, _MM_SHUFFLE(3, 3, 3, 3));
+    __m128 dstAlpha = _mm_shuffle_ps(d, d, _MM_SHUFFLE(3, 3, 3, 3));
+    __m128 srcWeight = _mm_mul_ps(srcAlpha, full);
+    __m128 dstWeight = _mm_mul_ps(dstAlpha, _mm_sub_ps(full, srcAlpha));
+    __m128 outAlpha = _mm_add_ps(srcWeight, dstWeight);
+    __m128 color = _mm_div_ps(_mm_add_ps(_mm_mul_ps(s, srcWeight), _mm_mul_ps(d, dstWeight)), outAlpha);
+    color = _mm_or_ps(_mm_andnot_ps(alphaLane, color), _mm_and_ps(alphaLane, _mm_div_ps(outAlpha, full)));
+
+    __m128 keep = _mm_cmpgt_ps(outAlpha, _mm_set1_ps(650.f));
+    __m128i out = _mm_cvttps_epi32(_mm_and_ps(color, keep));
+    __m128i copy = _mm_castps_si128(_mm_and_ps(_mm_cmpgt_ps(srcAlpha, opaque), _mm_cmpgt_ps(dstAlpha, opaque)));
+    return _mm_or_si128(_mm_andnot_si128(copy, out), _mm_and_si128(copy, s32));
+}
+
+// 4 pixels per iteration, the division needs 32 bit lanes so each pixel gets its own register
+__attribute__((target("sse2")))
+static void blendRGBAOverRGBASSE2(const uint8_t* src, uint8_t* dst, int count, uint8_t r, uint8_t g, uint8_t b) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i tint = _mm_setr_epi16(r, g, b, 255, r, g, b, 255);
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i*4));
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i*4));
+        __m128i sLo = div255x8(_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), tint));
+        __m128i sHi = div255x8(_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), tint));
+        __m128i dLo = _mm_unpacklo_epi8(d, zero);
+        __m128i dHi = _mm_unpackhi_epi8(d, zero);
+        __m128i p0 = blendOverRGBA(sLo, dLo);
+        __m128i p1 = blendOverRGBA(_mm_srli_si128(sLo, 8), _mm_srli_si128(dLo, 8));
+        __m128i p2 = blendOverRGBA(sHi, dHi);
+        __m128i p3 = blendOverRGBA(_mm_srli_si128(sHi, 8), _mm_srli_si128(dHi, 8));
+        _mm_storeu_si128((__m128i*)(dst + i*4), _mm_packus_epi16(_mm_packs_epi32(p0, p1), _mm_packs_epi32(p2, p3)));
+    }
+    blendRGBAOverRGBAScalar(src + i*4, dst + i*4, count - i, r, g, b);
+}
+
+#endif
+
+typedef void (*BlendRow)(const uint8_t* src, uint8_t* dst, int count, uint8_t r, uint8_t g, uint8_t b);
+
+struct BlendKernels {
+    BlendKernel kernel;
+    BlendRow rgbaOverRGB;
+    BlendRow rgbaOverRGBA;
+};
+
+static bool supported(BlendKernel kernel) {
+#ifdef BLEND_X86
+    __builtin_cpu_init();
+    switch (kernel) {
+        case BlendKernel::AVX2: return __builtin_cpu_supports("avx2");
+        case BlendKernel::SSSE3: return __builtin_cpu_supports("ssse3");
+        default: return true;
+    }
+#else
+    return kernel == BlendKernel::Scalar;
+#endif
+}
+
+static BlendKernels kernelsFor(BlendKernel kernel) {
+#ifdef BLEND_X86
+    // RGBA destinations have no wider kernel, SSE2 comes with both
+    switch (kernel) {
+        case BlendKernel::AVX2: return {kernel, blendRGBAOverRGBAVX2, blendRGBAOverRGBASSE2};
+        case BlendKernel::SSSE3: return {kernel, blendRGBAOverRGBSSSE3, blendRGBAOverRGBASSE2};
+        default: return {kernel, blendRGBAOverRGBScalar, blendRGBAOverRGBAScalar};
+    }
+#else
+    return {kernel, blendRGBAOverRGBScalar, blendRGBAOverRGBAScalar};
+#endif
+}
+
+static BlendKernels detectKernels() {
+    if (supported(BlendKernel::AVX2)) return kernelsFor(BlendKernel::AVX2);
+    if (supported(BlendKernel::SSSE3)) return kernelsFor(BlendKernel::SSSE3);
+    return kernelsFor(BlendKernel::Scalar);
+}
+
+static BlendKernels& kernels() {
+    static BlendKernels selected = detectKernels();
+    return selected;
+}
+
+BlendKernel blendKernel() {
+    return kernels().kernel;
+}
+
+const char* blendKernelName(BlendKernel kernel) {
+    switch (kernel) {
+        case BlendKernel::AVX2: return "avx2";
+        case BlendKernel::SSSE3: return "ssse3";
+        default: return "scalar";
+    }
+}
+
+bool setBlendKernel(BlendKernel kernel) {
+    if (!supported(kernel)) return false;
+    kernels() = kernelsFor(kernel);
+    return true;
+}
+
+void blendRowRGBAOverRGB(const uint8_t* src, uint8_t* dst, int count, uint8_t r, uint8_t g, uint8_t b) {
+    kernels().rgbaOverRGB(src, dst, count, r, g, b);
+}
+
+void blendRowRGBAOverRGBA(const uint8_t* src, uint8_t* dst, int count, uint8_t r, uint8_t g, uint8_t b) {
+    kernels().rgbaOverRGBA(src, dst, count, r, g, b);
+}
+
+void tintPixels(uint8_t* pixels, size_t count, int channels, uint8_t r, uint8_t g, uint8_t b) {
+    const uint8_t tint[3] = {r, g, b};
+    const int colors = channels < 3 ? 1 : 3;
+    for (size_t i = 0; i < count; i++, pixels += channels) {
+        for (int channel = 0; channel < colors; channel++) {
+            pixels[channel] = div255(pixels[channel] * tint[channel]);
+        }
+    }
+}
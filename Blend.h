@@ -0,0 +1,28 @@
+#ifndef BLEND_H
+#define BLEND_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// fixed-point alpha compositing of RGBA sprite rows, used by Image::overlay for the common channel layouts
+// the source is tinted by (r, g, b) / 255 on the way, pass 255 for no tint
+// results are identical whichever kernel runs, the vector kernels only change the speed
+
+enum class BlendKernel { Scalar, SSSE3, AVX2 };
+
+// picked once at startup from what the cpu supports
+BlendKernel blendKernel();
+const char* blendKernelName(BlendKernel kernel);
+// returns false (and keeps the current kernel) if the cpu can't run the requested one
+bool setBlendKernel(BlendKernel kernel);
+
+// dst is an opaque RGB row
+void blendRowRGBAOverRGB(const uint8_t* src, uint8_t* dst, int count, uint8_t r, uint8_t g, uint8_t b);
+// dst is an RGBA row with its own alpha
+void blendRowRGBAOverRGBA(const uint8_t* src, uint8_t* dst, int count, uint8_t r, uint8_t g, uint8_t b);
+
+// multiplies the color channels of every pixel (the first three, or the gray one with 1 or 2 channels) by (r, g, b) / 255,
+// rounding down
+void tintPixels(uint8_t* pixels, size_t count, int channels, uint8_t r, uint8_t g, uint8_t b);
+
+#endif
@@ -3,13 +3,95 @@
 #define BYTE_BOUND(value) value < 0 ? 0 : (value > 255 ? 255 : value)
 
 #include "Image.h"
+#include "Blend.h"
 
 #include "lib/stb_image.h"
 #include "lib/stb_image_write.h"
+#include "lib/thread_pool.hpp"
+
+#include <chrono>
+#include <filesystem>
+#include <numeric>
+#include <stdexcept>
+#include <fstream>
+#include <type_traits>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// calls f with the channel count as a std::integral_constant for the counts stb loads (1 gray, 2 gray + alpha, 3 RGB,
+// 4 RGBA), so kernels written against it get constant strides and fully unrolled channel loops, any other count
+// passes 0 and the kernel falls back to the runtime count
+template <typename F>
+static void withChannels(int channels, const F& f) {
+    switch (channels) {
+        case 1: f(std::integral_constant<int, 1>()); break;
+        case 2: f(std::integral_constant<int, 2>()); break;
+        case 3: f(std::integral_constant<int, 3>()); break;
+        case 4: f(std::integral_constant<int, 4>()); break;
+        default: f(std::integral_constant<int, 0>()); break;
+    }
+}
+
+// owned buffers come from calloc, big ones are then zeroed by the OS page by page as they're touched
+PixelBuffer::PixelBuffer(size_t size) {
+    if (size == 0) return;
+    pixels = (uint8_t*)calloc(size, 1);
+    if (pixels == nullptr) throw std::bad_alloc();
+    count = size;
+    release = free;
+}
+
+PixelBuffer::PixelBuffer(uint8_t* pixels, size_t size, Release release) : pixels(pixels), count(size), release(release) {}
+
+PixelBuffer::PixelBuffer(const PixelBuffer& other) : PixelBuffer(other.count) {
+    if (count) memcpy(pixels, other.pixels, count);
+}
+
+PixelBuffer::PixelBuffer(PixelBuffer&& other) noexcept : pixels(other.pixels), count(other.count), release(other.release) {
+    other.pixels = nullptr;
+    other.count = 0;
+    other.release = nullptr;
+}
+
+PixelBuffer& PixelBuffer::operator=(PixelBuffer other) noexcept {
+    std::swap(pixels, other.pixels);
+    std::swap(count, other.count);
+    std::swap(release, other.release);
+    return *this;
+}
+
+PixelBuffer::~PixelBuffer() {
+    if (pixels != nullptr && release != nullptr) release(pixels);
+}
+
+uint8_t& PixelBuffer::at(size_t i) {
+    if (i >= count) throw std::out_of_range("PixelBuffer::at");
+    return pixels[i];
+}
+
+const uint8_t& PixelBuffer::at(size_t i) const {
+    if (i >= count) throw std::out_of_range("PixelBuffer::at");
+    return pixels[i];
+}
+
+void PixelBuffer::resize(size_t size) {
+    if (size == count) return;
+    PixelBuffer resized(size);
+    if (count) memcpy(resized.pixels, pixels, std::min(size, count));
+    *this = std::move(resized);
+}
 
 Image::Image() : w(100), h(100), channels(3) {
     size = w*h*channels;
-    data = std::vector<uint8_t>(size);
+    data = PixelBuffer(size);
 }
 
 Image::Image(const char* filename) {
@@ -17,156 +99,458 @@ Image::Image(const char* filename) {
         // std::cout<<"Read "<<filename<<" Width: "<<w<<" Height: "<<h<<" Channels: "<<channels<<std::endl;
         size = w*h*channels;
     } else {
-        std::cout<<"Failed to read "<<filename<<std::endl;
+        std::cerr<<"Failed to read "<<filename<<std::endl;
     }
 }
 
 Image::Image(int w, int h, int channels) : w(w), h(h), channels(channels) {
     size = w*h*channels;
-    data = std::vector<uint8_t>(size);
+    data = PixelBuffer(size);
 }
 
-Image::Image(const Image& img) : w(img.w), h(img.h), channels(img.channels), data(img.data) {
+Image::Image(const Image& img) : data(img.data), w(img.w), h(img.h), channels(img.channels) {
     size = w*h*channels;
 }
 
+Image::Image(Image&& img) noexcept : data(std::move(img.data)), size(img.size), w(img.w), h(img.h), channels(img.channels) {}
+
 bool Image::read(const char* filename) {
     uint8_t* temp = stbi_load(filename, &w, &h, &channels, 0);
+    if (temp == nullptr) {
+        w = h = channels = 0;
+        size = 0;
+        return false;
+    }
+    // stb's buffer becomes the image's, a frame is decoded once and never copied
     size = w*h*channels;
-    data.insert(data.end(), &temp[0], &temp[size]);
-    stbi_image_free(temp);
+    data = PixelBuffer(temp, size, stbi_image_free);
     return true;
 }
 
+static bool pngStore = false;
+
+void Image::setPngCompression(int level, int filter) {
+    pngStore = level <= 0;
+    stbi_write_png_compression_level = level;
+    stbi_write_force_png_filter = filter;
+}
+
+static void pushBigEndian(std::vector<uint8_t>& out, uint32_t value) {
+    out.push_back(value >> 24);
+    out.push_back(value >> 16);
+    out.push_back(value >> 8);
+    out.push_back(value);
+}
+
+static void pushChunk(std::vector<uint8_t>& out, const char* tag, const std::vector<uint8_t>& body) {
+    pushBigEndian(out, body.size());
+    size_t start = out.size();
+    out.insert(out.end(), tag, tag + 4);
+    out.insert(out.end(), body.begin(), body.end());
+    pushBigEndian(out, stbiw__crc32(out.data() + start, out.size() - start));
+}
+
+// stb can't skip deflate, so level 0 builds the PNG itself: no row filters and the zlib stream
+// made of stored blocks, which is about as fast as copying the pixels
+static void storePng(const Image& img, std::vector<uint8_t>& png) {
+    static const uint8_t signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    static const uint8_t colorTypes[] = { 0, 0, 4, 2, 6 };
+    png.assign(signature, signature + 8);
+
+    std::vector<uint8_t> header;
+    pushBigEndian(header, img.w);
+    pushBigEndian(header, img.h);
+    header.insert(header.end(), { 8, colorTypes[img.channels], 0, 0, 0 });
+    pushChunk(png, "IHDR", header);
+
+    // every row gets its filter byte (0, none) in front
+    size_t stride = (size_t)img.w * img.channels;
+    std::vector<uint8_t> raw;
+    raw.reserve((stride + 1) * img.h);
+    for (int y = 0; y < img.h; y++) {
+        raw.push_back(0);
+        raw.insert(raw.end(), img.data.begin() + y * stride, img.data.begin() + (y + 1) * stride);
+    }
+
+    std::vector<uint8_t> zlib = { 0x78, 0x01 };
+    zlib.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+    uint32_t a = 1, b = 0;
+    size_t offset = 0;
+    do {
+        uint16_t length = std::min<size_t>(raw.size() - offset, 65535);
+        bool last = offset + length == raw.size();
+        zlib.insert(zlib.end(), { (uint8_t)last, (uint8_t)length, (uint8_t)(length >> 8), (uint8_t)~length, (uint8_t)(~length >> 8) });
+        zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + length);
+        // adler32, 5552 bytes is the most that can be summed before the 32 bit sums need reducing
+        for (size_t i = offset; i < offset + length; i += 5552) {
+            for (size_t j = i; j < std::min<size_t>(i + 5552, offset + length); j++) {
+                a += raw[j];
+                b += a;
+            }
+            a %= 65521;
+            b %= 65521;
+        }
+        offset += length;
+    } while (offset < raw.size());
+    pushBigEndian(zlib, (b << 16) | a);
+    pushChunk(png, "IDAT", zlib);
+
+    pushChunk(png, "IEND", {});
+}
+
 bool Image::write(const char* filename) const {
+    if (pngStore) {
+        std::vector<uint8_t> png;
+        storePng(*this, png);
+        FILE* file = fopen(filename, "wb");
+        if (file == nullptr) return false;
+        bool success = fwrite(png.data(), 1, png.size(), file) == png.size();
+        return fclose(file) == 0 && success;
+    }
     int success;
     success = stbi_write_png(filename, w, h, channels, data.data(), w*channels);
     return success != 0;
 }
 
-Image& Image::colorMask(float r, float g, float b) {
-    for (int i = 0; i < size; i+=channels) {
-        data.at(i)   *= r;
-        data.at(i+1) *= g;
-        data.at(i+2) *= b;
+// PNG into memory, so encoding and writing the file can happen on different threads
+bool Image::encode(std::vector<uint8_t>& png) const {
+    png.clear();
+    if (pngStore) {
+        storePng(*this, png);
+        return true;
+    }
+    int success;
+    success = stbi_write_png_to_func([](void* context, void* bytes, int length) {
+        std::vector<uint8_t>* out = (std::vector<uint8_t>*)context;
+        out->insert(out->end(), (uint8_t*)bytes, (uint8_t*)bytes + length);
+    }, &png, w, h, channels, data.data(), w*channels);
+    return success != 0;
+}
+
+static inline uint64_t rotateLeft(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// murmur3 style mixing over 8 byte words, a few GB/s which is noise next to decoding a PNG
+uint64_t hashBytes(const uint8_t* bytes, size_t length, uint64_t seed) {
+    uint64_t value = seed;
+    size_t words = length / 8;
+    for (size_t i = 0; i <= words; i++) {
+        uint64_t k = 0;
+        memcpy(&k, bytes + i * 8, i < words ? 8 : length % 8);
+        k *= 0x87c37b91114253d5ull;
+        k = rotateLeft(k, 31);
+        k *= 0x4cf5ad432745937full;
+        value ^= k;
+        value = rotateLeft(value, 27) * 5 + 0x52dce729;
     }
+
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdull;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ull;
+    value ^= value >> 33;
+    return value;
+}
+
+uint64_t Image::hash() const {
+    return hashBytes(data.data(), data.size(), 0x9e3779b97f4a7c15ull ^ ((uint64_t)w << 40) ^ ((uint64_t)h << 16) ^ channels);
+}
+
+// the color channels (all three, or the one of a gray / gray + alpha image) scaled and truncated, alpha is left alone
+Image& Image::colorMask(float r, float g, float b) {
+    const float tint[3] = {r, g, b};
+    withChannels(channels, [&](auto c) {
+        const int stride = c ? c : channels;
+        const int colors = stride < 3 ? 1 : 3;
+        uint8_t* pixel = data.data();
+        for (size_t i = 0; i < (size_t)w * h; i++, pixel += stride) {
+            for (int channel = 0; channel < colors; channel++) {
+                pixel[channel] = (uint8_t)(pixel[channel] * tint[channel]);
+            }
+        }
+    });
     return *this;
 }
 
-Image Image::colorMaskNew(float r, float g, float b) {
+Image Image::colorMaskNew(float r, float g, float b) const {
     Image new_version = *this;
-    for (int i = 0; i < size; i+=channels) {
-        new_version.data.at(i)   *= r;
-        new_version.data.at(i+1) *= g;
-        new_version.data.at(i+2) *= b;
-    }
+    new_version.colorMask(r, g, b);
     return new_version;
 }
 
-Image& Image::overlay(const Image& source, int x, int y) {
-
-    for (int sy = 0; sy < source.h; sy++) {
-        if (sy + y < 0) continue; else if (sy + y >= h) break;
-        for (int sx = 0; sx < source.w; sx++) {
-            if (sx + x < 0) continue; else if (sx + x >= w) break;
+// the per-pixel float blend for everything the Blend row kernels don't cover, with the source pixel brought to the
+// target's channels first (gray spread to RGB, a missing alpha opaque) and its color channels tinted
+// 1 and 3 channels are gray and RGB, 2 and 4 the same with alpha after the colors
+template <int S, int D>
+static void overlayPixels(const Sprite& source, Image& target, int x, int y, const float tint[3]) {
+    const int sc = S ? S : source.channels;
+    const int dc = D ? D : std::min(target.channels, 4); // stb never loads more than 4
+    const int srcColors = sc < 3 ? 1 : 3;
+    const int dstColors = dc < 3 ? 1 : 3;
+    const int srcAlphaAt = sc == 2 || sc >= 4 ? srcColors : -1;
+    const int dstAlphaAt = dc == 2 || dc == 4 ? dstColors : -1;
+    int x0 = std::max(0, -x);
+    int x1 = std::min(source.w, target.w - x);
+    int y0 = std::max(0, -y);
+    int y1 = std::min(source.h, target.h - y);
+    uint8_t tinted[3];
+
+    for (int sy = y0; sy < y1; sy++) {
+        const uint8_t* src = source.data + ((size_t)sy * source.w + x0) * sc;
+        uint8_t* dst = target.data.data() + ((size_t)(sy + y) * target.w + x0 + x) * dc;
+        for (int sx = x0; sx < x1; sx++, src += sc, dst += dc) {
+            for (int channel = 0; channel < dstColors; channel++) {
+                tinted[channel] = (uint8_t)(src[channel < srcColors ? channel : 0] * tint[channel]);
+            }
 
-            float srcAlpha = source.channels < 4 ? 1 : source.data.at(((sx + sy * source.w) * source.channels) + 3) / 255.f;
-            float dstAlpha = channels < 4 ? 1 : data.at(((sx + x + (sy + y) * w) * channels) + 3) / 255.f;
+            float srcAlpha = srcAlphaAt < 0 ? 1 : src[srcAlphaAt] / 255.f;
+            float dstAlpha = dstAlphaAt < 0 ? 1 : dst[dstAlphaAt] / 255.f;
 
             if (srcAlpha > .99 && dstAlpha > .99) {
-                for (int channel = 0; channel < channels; channel++) {
-                    data.at(((sx + x + (sy + y) * w) * channels) + channel) = source.data.at(((sx + sy * source.w) * source.channels) + channel);
+                for (int channel = 0; channel < dstColors; channel++) {
+                    dst[channel] = tinted[channel];
                 }
+                if (dstAlphaAt >= 0) dst[dstAlphaAt] = srcAlphaAt < 0 ? 255 : src[srcAlphaAt];
             } else {
                 float outAlpha = srcAlpha + dstAlpha * (1 - srcAlpha);
                 if (outAlpha < .01) {
-                    for (int channel = 0; channel < channels; channel++) {
-                        data.at(((sx + x + (sy + y) * w) * channels) + channel) = 0;
+                    for (int channel = 0; channel < dc; channel++) {
+                        dst[channel] = 0;
                     }
                 } else {
-                    for (int channel = 0; channel < channels; channel++) {
-                        data.at(((sx + x + (sy + y) * w) * channels) + channel) = (uint8_t)BYTE_BOUND((source.data.at(((sx + sy * source.w) * source.channels) + channel)/255.f * srcAlpha + data.at(((sx + x + (sy + y) * w) * channels) + channel)/255.f * dstAlpha * (1 - srcAlpha)) / outAlpha * 255.f);
+                    for (int channel = 0; channel < dstColors; channel++) {
+                        dst[channel] = (uint8_t)BYTE_BOUND((tinted[channel]/255.f * srcAlpha + dst[channel]/255.f * dstAlpha * (1 - srcAlpha)) / outAlpha * 255.f);
                     }
-                    if (channels > 3) data.at(((sx + x + (sy + y) * w) * channels) + 3) = (uint8_t)BYTE_BOUND(outAlpha * 255.f);
+                    if (dstAlphaAt >= 0) dst[dstAlphaAt] = (uint8_t)BYTE_BOUND(outAlpha * 255.f);
                 }
             }
         }
     }
+}
+
+static void overlayAny(const Sprite& source, Image& target, int x, int y, const float tint[3]) {
+    withChannels(source.channels, [&](auto s) {
+        withChannels(target.channels, [&](auto d) {
+            overlayPixels<decltype(s)::value, decltype(d)::value>(source, target, x, y, tint);
+        });
+    });
+}
+
+Image& Image::overlay(const Sprite& source, int x, int y) {
+    if (source.channels == 4 && (channels == 3 || channels == 4)) {
+        return overlayRows(source, x, y, 255, 255, 255);
+    }
 
+    static const float untinted[3] = {1, 1, 1};
+    overlayAny(source, *this, x, y, untinted);
     return *this;
 }
 
-Image& Image::resizeFast(uint16_t rw, uint16_t rh) {
-    std::vector<uint8_t> resizedImage(rw * rh * channels);
+// overlay(source.colorMaskNew(r, g, b), x, y) without the tinted copy, the tint is applied per pixel on the way
+Image& Image::overlay(const Sprite& source, int x, int y, float r, float g, float b) {
+    if (source.channels == 4 && (channels == 3 || channels == 4)) {
+        return overlayRows(source, x, y, (uint8_t)(r * 255.f + .5f), (uint8_t)(g * 255.f + .5f), (uint8_t)(b * 255.f + .5f));
+    }
 
-    double x_ratio = w/(double)rw;
-    double y_ratio = h/(double)rh;
-    double rx, ry ;
-    for (int y = 0; y < rh; y++) {
-        for (int x = 0; x < rw; x++) {
-            rx = floor(x * x_ratio);
-            ry = floor(y * y_ratio);
-            for (int channel = 0; channel < channels; channel++) {
-                resizedImage.at((((y*rw)+x) * channels) + channel) = data.at((((ry*w)+rx) * channels) + channel);
-            }
-        }                
-    }          
+    const float tint[3] = {r, g, b};
+    overlayAny(source, *this, x, y, tint);
+    return *this;
+}
+
+// RGBA sprites over RGB / RGBA frames, clipped once and handed to the fixed-point row kernels in Blend
+Image& Image::overlayRows(const Sprite& source, int x, int y, uint8_t r, uint8_t g, uint8_t b) {
+    int x0 = std::max(0, -x);
+    int x1 = std::min(source.w, w - x);
+    int y0 = std::max(0, -y);
+    int y1 = std::min(source.h, h - y);
+    if (x0 >= x1) return *this;
+
+    for (int sy = y0; sy < y1; sy++) {
+        const uint8_t* src = source.data + ((size_t)sy * source.w + x0) * 4;
+        uint8_t* dst = data.data() + ((size_t)(sy + y) * w + x0 + x) * channels;
+        if (channels == 3) {
+            blendRowRGBAOverRGB(src, dst, x1 - x0, r, g, b);
+        } else {
+            blendRowRGBAOverRGBA(src, dst, x1 - x0, r, g, b);
+        }
+    }
+
+    return *this;
+}
+
+Image& Image::resizeFast(uint16_t rw, uint16_t rh) {
+    PixelBuffer resizedImage((size_t)rw * rh * channels);
+    resizeInto(resizedImage.data(), rw, rh);
 
     w = rw;
     h = rh;
     size = w * h * channels;
 
-    data = resizedImage;
+    data = std::move(resizedImage);
 
     return *this;
 }
 
-Image Image::resizeFastNew(uint16_t rw, uint16_t rh) {
-    Image new_version = *this;
-    std::vector<uint8_t> resizedImage(rw * rh * channels);
+Image Image::resizeFastNew(uint16_t rw, uint16_t rh) const {
+    Image new_version(rw, rh, channels);
+    resizeInto(new_version.data.data(), rw, rh);
+    return new_version;
+}
 
+// nearest neighbor into rw * rh * channels bytes at out, the source column of every x is worked out once
+void Image::resizeInto(uint8_t* out, uint16_t rw, uint16_t rh) const {
     double x_ratio = w/(double)rw;
     double y_ratio = h/(double)rh;
-    double rx, ry ;
-    for (int y = 0; y < rh; y++) {
-        for (int x = 0; x < rw; x++) {
-            rx = floor(x * x_ratio);
-            ry = floor(y * y_ratio);
-            for (int channel = 0; channel < channels; channel++) {
-                resizedImage.at((((y*rw)+x) * channels) + channel) = data.at((((ry*w)+rx) * channels) + channel);
+    std::vector<size_t> columns(rw);
+    for (int x = 0; x < rw; x++) {
+        columns[x] = (size_t)floor(x * x_ratio) * channels;
+    }
+    withChannels(channels, [&](auto c) {
+        const int stride = c ? c : channels;
+        for (int y = 0; y < rh; y++) {
+            const uint8_t* row = data.data() + (size_t)floor(y * y_ratio) * w * stride;
+            for (int x = 0; x < rw; x++, out += stride) {
+                for (int channel = 0; channel < stride; channel++) {
+                    out[channel] = row[columns[x] + channel];
+                }
             }
-        }                
-    }           
-
-    new_version.w = rw;
-    new_version.h = rh;
-    new_version.size = rw * rh * channels;
-
-    new_version.data = resizedImage;
+        }
+    });
+}
 
+Image Image::resizeAreaNew(uint16_t rw, uint16_t rh) const {
+    Image new_version(rw, rh, channels);
+    resizeAreaInto(new_version.data.data(), rw, rh);
     return new_version;
 }
 
-Image Image::cropNew(uint16_t cx, uint16_t cy, uint16_t cw, uint16_t ch) {
-    Image new_version = *this;
+// one output pixel of rw covers source pixels [x * w / rw, (x + 1) * w / rw), so in units of 1 / rw of a source pixel
+// it covers [x * w, (x + 1) * w) and source pixel i covers [i * rw, (i + 1) * rw), the overlaps are integer weights
+// that add up to w per column and h per row
+// the weights of output pixel x are weights[spans[x] .. spans[x + 1]), starting at source pixel first[x]
+static void areaWeights(int size, int target, std::vector<int>& first, std::vector<uint32_t>& spans, std::vector<uint32_t>& weights) {
+    first.resize(target);
+    int divisor = std::gcd(size, target); // keeps the sums small, weights then add up to size / divisor
+    spans.assign(1, 0);
+    weights.clear();
+    for (int x = 0; x < target; x++) {
+        int64_t begin = (int64_t)x * size;
+        int64_t end = begin + size;
+        first[x] = begin / target;
+        for (int64_t i = first[x]; i * target < end; i++) {
+            weights.push_back((std::min(end, (i + 1) * target) - std::max(begin, i * target)) / divisor);
+        }
+        spans.push_back(weights.size());
+    }
+}
 
-    std::vector<uint8_t> croppedImage(cw * ch * channels);
+// box filter into rw * rh * channels bytes at out, every source pixel weighted by how much of the output pixel
+// it covers, colours also by their alpha so transparent pixels don't bleed into the edges
+// separable: source rows are first filtered horizontally into a small ring of rw wide rows (alpha premultiplied, the
+// reduced weights keep a row's sums far below 32 bits), output rows then add up the ring rows they cover, all sums
+// are integers and only the final division by the covered weight goes through a reciprocal
+template <int Channels, typename Sum>
+static void boxFilter(const uint8_t* data, int w, int h, uint8_t* out, int rw, int rh) {
+    std::vector<int> firstColumn, firstRow;
+    std::vector<uint32_t> columnSpans, rowSpans, columnWeights, rowWeights;
+    areaWeights(w, rw, firstColumn, columnSpans, columnWeights);
+    areaWeights(h, rh, firstRow, rowSpans, rowWeights);
+
+    constexpr bool alpha = Channels == 2 || Channels == 4;
+    constexpr int colours = alpha ? Channels - 1 : Channels;
+    size_t ringSize = 0;
+    for (int y = 0; y < rh; y++) {
+        ringSize = std::max<size_t>(ringSize, rowSpans[y + 1] - rowSpans[y]);
+    }
+    std::vector<uint32_t> ring(ringSize * rw * Channels);
+    std::vector<int> ringRows(ringSize, -1);
+    auto filteredRow = [&](int sy) {
+        uint32_t* filtered = ring.data() + (sy % ringSize) * rw * Channels;
+        if (ringRows[sy % ringSize] == sy) return (const uint32_t*)filtered;
+        ringRows[sy % ringSize] = sy;
+        const uint8_t* row = data + (size_t)sy * w * Channels;
+        uint32_t* sums = filtered;
+        for (int x = 0; x < rw; x++, sums += Channels) {
+            const uint8_t* src = row + (size_t)firstColumn[x] * Channels;
+            uint32_t sum[Channels] = {};
+            for (uint32_t i = columnSpans[x]; i < columnSpans[x + 1]; i++, src += Channels) {
+                uint32_t weight = columnWeights[i];
+                if (alpha) {
+                    weight *= src[colours];
+                    sum[colours] += weight;
+                }
+                for (int channel = 0; channel < colours; channel++) {
+                    sum[channel] += src[channel] * weight;
+                }
+            }
+            std::copy(sum, sum + Channels, sums);
+        }
+        return (const uint32_t*)filtered;
+    };
 
-    for (uint16_t y = 0; y < ch; y++) {
-        if (y + cy >= h) break;
-        for (uint16_t x = 0; x < cw; x++) {
-            if (x + cx >= w) break;
-            for (int channel = 0; channel < channels; channel++) {
-                croppedImage.at(((x + y * cw) * channels) + channel) = data.at(((x + cx + (y + cy) * w) * channels) + channel);
+    uint64_t total = (uint64_t)(w / std::gcd(w, rw)) * (h / std::gcd(h, rh));
+    uint64_t opaque = alpha ? total * 255 : total; // the usual divisor, inside a sprite or without alpha
+    double opaqueScale = 1.0 / opaque;
+    std::vector<Sum> sums((size_t)rw * Channels);
+    for (int y = 0; y < rh; y++) {
+        std::fill(sums.begin(), sums.end(), 0);
+        for (uint32_t j = rowSpans[y]; j < rowSpans[y + 1]; j++) {
+            const uint32_t* row = filteredRow(firstRow[y] + (j - rowSpans[y]));
+            Sum weight = rowWeights[j];
+            for (size_t k = 0; k < sums.size(); k++) {
+                sums[k] += row[k] * weight;
+            }
+        }
+
+        uint8_t* dst = out + (size_t)y * rw * Channels;
+        for (int x = 0; x < rw; x++, dst += Channels) {
+            const Sum* sum = sums.data() + (size_t)x * Channels;
+            uint64_t divisor = alpha ? sum[colours] : total;
+            double scale = divisor == opaque ? opaqueScale : (divisor ? 1.0 / divisor : 0);
+            for (int channel = 0; channel < colours; channel++) {
+                dst[channel] = sum[channel] * scale + .5;
             }
+            if (alpha) dst[colours] = sum[colours] * opaqueScale * 255 + .5;
         }
     }
+}
 
-    new_version.w = cw;
-    new_version.h = ch;
-    new_version.size = cw*ch*channels;
+template <int Channels>
+static void boxFilter(const uint8_t* data, int w, int h, uint8_t* out, int rw, int rh) {
+    uint64_t total = (uint64_t)(w / std::gcd(w, rw)) * (h / std::gcd(h, rh));
+    if (total * 255 * 255 <= UINT32_MAX) boxFilter<Channels, uint32_t>(data, w, h, out, rw, rh);
+    else boxFilter<Channels, uint64_t>(data, w, h, out, rw, rh);
+}
 
-    new_version.data = croppedImage;
+void Image::resizeAreaInto(uint8_t* out, uint16_t rw, uint16_t rh) const {
+    switch (channels) {
+        case 1: boxFilter<1>(data.data(), w, h, out, rw, rh); break;
+        case 2: boxFilter<2>(data.data(), w, h, out, rw, rh); break;
+        case 3: boxFilter<3>(data.data(), w, h, out, rw, rh); break;
+        case 4: boxFilter<4>(data.data(), w, h, out, rw, rh); break;
+    }
+}
+
+// each level half the size of the one before (rounded down), made from it with the box filter, down to 1 x 1
+std::vector<Image> Image::mipChain() const {
+    std::vector<Image> levels = { *this };
+    while (levels.back().w > 1 || levels.back().h > 1) {
+        const Image& last = levels.back();
+        levels.push_back(last.resizeAreaNew(std::max(1, last.w / 2), std::max(1, last.h / 2)));
+    }
+    return levels;
+}
+
+// the part of a row inside the image is one run of bytes whatever the channels, what's outside stays black
+Image Image::cropNew(uint16_t cx, uint16_t cy, uint16_t cw, uint16_t ch) {
+    Image new_version(cw, ch, channels);
+    size_t inside = cx < w ? (size_t)std::min<int>(cw, w - cx) * channels : 0;
+
+    for (uint16_t y = 0; y < ch && y + cy < h; y++) {
+        const uint8_t* src = data.data() + ((size_t)(y + cy) * w + cx) * channels;
+        std::copy(src, src + inside, new_version.data.begin() + (size_t)y * cw * channels);
+    }
 
     return new_version;
 }
@@ -250,21 +634,101 @@ Image& Image::rectOutline(uint8_t r, uint8_t g, uint8_t b) {
     return *this;
 }
 
-Image Image::quadifyFrameBW(std::map<std::pair<int, int>, Image>& resizedAmogi) {
-    Image frame(w, h, 3);
+int SubtreeTasks::depthFor(const work_stealing_pool& pool) {
+    int depth = 1;
+    while (((size_t)1 << (2 * depth)) < 4 * (size_t)pool.get_thread_count()) depth++;
+    return depth;
+}
 
-    subdivideBW(0, 0, w, h, frame, resizedAmogi);
+void SubtreeTasks::defer(Quadtree& tree, uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh, int level, int ix, int iy, int previous) {
+    tasks.push_back(Task{sx, sy, sw, sh, level, ix, iy, previous, tree.add(sx, sy, sw, sh, level, 0, 0, 0)});
+}
 
-    return frame;
+// builds the deferred subtrees on the pool and splices each into its placeholder
+// a node of the top of the tree moves back by what the placeholders before it grew by, so does its end
+template <typename F>
+static void buildSubtrees(Quadtree& tree, const SubtreeTasks& tasks, work_stealing_pool* pool, const F& build) {
+    if (tasks.tasks.empty()) return;
+    std::vector<Quadtree> subtrees(tasks.tasks.size(), Quadtree(tree.w, tree.h));
+    pool->parallelize_loop((size_t)0, subtrees.size() - 1, [&](size_t k) { build(tasks.tasks[k], subtrees[k]); }, subtrees.size());
+
+    std::vector<uint32_t> shift(tree.nodes.size() + 1);
+    uint32_t grown = 0;
+    for (size_t i = 0, k = 0; i <= tree.nodes.size(); i++) {
+        shift[i] = grown;
+        if (k < subtrees.size() && tasks.tasks[k].node == i) grown += subtrees[k++].nodes.size() - 1;
+    }
+    std::vector<QuadNode> nodes;
+    nodes.reserve(tree.nodes.size() + grown);
+    for (size_t i = 0, k = 0; i < tree.nodes.size(); i++) {
+        if (k < subtrees.size() && tasks.tasks[k].node == i) {
+            uint32_t offset = nodes.size();
+            for (QuadNode node : subtrees[k++].nodes) {
+                node.end += offset;
+                nodes.push_back(node);
+            }
+            continue;
+        }
+        nodes.push_back(tree.nodes[i]);
+        nodes.back().end += shift[nodes.back().end];
+    }
+    tree.nodes = std::move(nodes);
+}
+
+Image Image::quadifyFrameBW(const SpriteAtlas& sprites, int frame, Analysis analysis, TintCache* tintCache, FrameDelta* delta, work_stealing_pool* pool) {
+    Quadtree tree = analyzeBW(analysis, delta, pool);
+    Image frameBW = tree.render(sprites, frame, tintCache, delta && delta->previous ? &delta->previous->output : nullptr, pool);
+    if (delta) delta->tree = std::move(tree);
+    return frameBW;
+}
+
+Quadtree Image::analyzeBW(Analysis analysis, FrameDelta* delta, work_stealing_pool* pool) {
+    Quadtree tree(w, h);
+    int previous = delta && delta->previous ? 0 : -1;
+    if (previous >= 0 && delta->unchanged(0, 0, w, h)) {
+        tree.reuse(delta->previous->tree, 0);
+        delta->tiles = delta->previous->tiles;
+        return tree;
+    }
+
+    SubtreeTasks tasks(pool ? SubtreeTasks::depthFor(*pool) : -1);
+    SubtreeTasks* deferred = pool ? &tasks : nullptr;
+    if (analysis == Analysis::Pyramid) {
+        BlockPyramid pyramid(*this, 1, splitLimitsBW.minSplit, pool);
+        subdivideBW(pyramid, 0, 0, 0, previous, tree, delta, deferred);
+        buildSubtrees(tree, tasks, pool, [&](const SubtreeTasks::Task& task, Quadtree& subtree) {
+            subdivideBW(pyramid, task.depth, task.ix, task.iy, task.previous, subtree, delta);
+        });
+        return tree;
+    }
+
+    SummedAreaTable table = delta ? SummedAreaTable(*this, 1, false, *delta, pool) : SummedAreaTable(*this, 1, false, pool);
+    subdivideBW(0, 0, w, h, 0, previous, table, tree, delta, deferred);
+    buildSubtrees(tree, tasks, pool, [&](const SubtreeTasks::Task& task, Quadtree& subtree) {
+        subdivideBW(task.sx, task.sy, task.sw, task.sh, task.depth, task.previous, table, subtree, delta);
+    });
+    if (delta) delta->tiles = std::move(table.tiles);
+
+    return tree;
 }
 
 // sw: subdivided x | sy subdivided y
 // sw: subdivided width | sh subdivided height
-void Image::subdivideBW(uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh, Image& frame, std::map<std::pair<int, int>, Image>& resizedAmogi) {
+// previous: the node for the same block in the delta's reference tree, -1 if that tree didn't reach it
+void Image::subdivideBW(uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh, int depth, int previous, const SummedAreaTable& table, Quadtree& tree, FrameDelta* delta, SubtreeTasks* tasks) {
+    if (previous >= 0 && delta->unchanged(sx, sy, sw, sh)) {
+        tree.reuse(delta->previous->tree, previous);
+        return;
+    }
+    if (tasks && depth == tasks->depth) {
+        tasks->defer(tree, sx, sy, sw, sh, depth, 0, 0, previous);
+        return;
+    }
 
-    int val = subdivideCheckBW(sx, sy, sw, sh);
+    int val = subdivideCheckBW(table, sx, sy, sw, sh);
+    size_t node = tree.add(sx, sy, sw, sh, depth, val, val, val);
 
-    if (val > 0 && val < 255 && sw > 16 && sh > 16) {
+    if (val > 0 && val < 255 && sw > splitLimitsBW.minSplit && sh > splitLimitsBW.minSplit) {
         uint16_t sw_l, sw_r, sh_t, sh_b;
         if (sw % 2 == 0) {
             sw_l = sw/2;
@@ -280,45 +744,123 @@ void Image::subdivideBW(uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh, Imag
             sh_t = floor(sh/2);
             sh_b = ceil(sh/2) + 1;
         }
-        subdivideBW(sx, sy, sw_l, sh_t, frame, resizedAmogi);
-        subdivideBW(sx + sw_r, sy, sw_l, sh_t, frame, resizedAmogi);
-        subdivideBW(sx, sy + sh_b, sw_l, sh_t, frame, resizedAmogi);
-        subdivideBW(sx + sw_r, sy + sh_b, sw_l, sh_t, frame, resizedAmogi);
+        const Quadtree* reference = delta && delta->previous ? &delta->previous->tree : nullptr;
+        subdivideBW(sx, sy, sw_l, sh_t, depth + 1, Quadtree::child(reference, previous, 0), table, tree, delta, tasks);
+        subdivideBW(sx + sw_r, sy, sw_l, sh_t, depth + 1, Quadtree::child(reference, previous, 1), table, tree, delta, tasks);
+        subdivideBW(sx, sy + sh_b, sw_l, sh_t, depth + 1, Quadtree::child(reference, previous, 2), table, tree, delta, tasks);
+        subdivideBW(sx + sw_r, sy + sh_b, sw_l, sh_t, depth + 1, Quadtree::child(reference, previous, 3), table, tree, delta, tasks);
     } else {
-        if (val <= 20) return;
-        frame.overlay(resizedAmogi[std::make_pair(sw, sh)].colorMaskNew(val/255.f, val/255.f, val/255.f), sx, sy);
+        tree.nodes[node].flags = QuadNode::Leaf | (val > 20 ? QuadNode::Drawn : 0);
     }
+    tree.nodes[node].end = tree.nodes.size();
+}
+
+// same decisions as above, but the block statistics come from the pyramid instead
+void Image::subdivideBW(const BlockPyramid& pyramid, int level, int ix, int iy, int previous, Quadtree& tree, FrameDelta* delta, SubtreeTasks* tasks) {
+    uint16_t sx = pyramid.xs[level][ix];
+    uint16_t sy = pyramid.ys[level][iy];
+    uint16_t sw = pyramid.ws[level];
+    uint16_t sh = pyramid.hs[level];
+    if (previous >= 0 && delta->unchanged(sx, sy, sw, sh)) {
+        tree.reuse(delta->previous->tree, previous);
+        return;
+    }
+    if (tasks && level == tasks->depth) {
+        tasks->defer(tree, sx, sy, sw, sh, level, ix, iy, previous);
+        return;
+    }
+
+    int val = pyramid.mean(level, ix, iy, 0);
+    size_t node = tree.add(sx, sy, sw, sh, level, val, val, val);
+
+    if (val > 0 && val < 255 && sw > splitLimitsBW.minSplit && sh > splitLimitsBW.minSplit) {
+        const Quadtree* reference = delta && delta->previous ? &delta->previous->tree : nullptr;
+        subdivideBW(pyramid, level + 1, ix*2, iy*2, Quadtree::child(reference, previous, 0), tree, delta, tasks);
+        subdivideBW(pyramid, level + 1, ix*2 + 1, iy*2, Quadtree::child(reference, previous, 1), tree, delta, tasks);
+        subdivideBW(pyramid, level + 1, ix*2, iy*2 + 1, Quadtree::child(reference, previous, 2), tree, delta, tasks);
+        subdivideBW(pyramid, level + 1, ix*2 + 1, iy*2 + 1, Quadtree::child(reference, previous, 3), tree, delta, tasks);
+    } else {
+        tree.nodes[node].flags = QuadNode::Leaf | (val > 20 ? QuadNode::Drawn : 0);
+    }
+    tree.nodes[node].end = tree.nodes.size();
 }
 
 int Image::subdivideCheckBW(uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh) {
     int sum = 0;
 
-    for (uint16_t y = sy; y < sh + sy; y++) {
-        for (uint16_t x = sx; x < sw + sx; x++) {
-            sum += data.at((x + y * w) * channels);
+    withChannels(channels, [&](auto c) {
+        const int stride = c ? c : channels;
+        for (uint16_t y = sy; y < sh + sy; y++) {
+            const uint8_t* pixel = data.data() + ((size_t)y * w + sx) * stride;
+            for (uint16_t x = 0; x < sw; x++, pixel += stride) {
+                sum += pixel[0];
+            }
         }
-    }
+    });
 
     return (int)sum/(sh*sw);
 }
 
-Image Image::quadifyFrameRGB(std::map<std::pair<int, int>, Image>& resizedAmogi) {
-    Image frameRGB(w, h, 3);
-
-    subdivideRGB(0, 0, w, h, frameRGB, resizedAmogi);
+int Image::subdivideCheckBW(const SummedAreaTable& table, uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh) const {
+    return (int)(table.blockSum(0, sx, sy, sw, sh)/(sh*sw));
+}
 
+Image Image::quadifyFrameRGB(const SpriteAtlas& sprites, int frame, Analysis analysis, FrameDelta* delta, work_stealing_pool* pool) {
+    Quadtree tree = analyzeRGB(analysis, delta, pool);
+    Image frameRGB = tree.render(sprites, frame, nullptr, delta && delta->previous ? &delta->previous->output : nullptr, pool);
+    if (delta) delta->tree = std::move(tree);
     return frameRGB;
 }
 
-void Image::subdivideRGB(uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh, Image& frameRGB, std::map<std::pair<int, int>, Image>& resizedAmogi) {
+Quadtree Image::analyzeRGB(Analysis analysis, FrameDelta* delta, work_stealing_pool* pool) {
+    Quadtree tree(w, h);
+    int previous = delta && delta->previous ? 0 : -1;
+    if (previous >= 0 && delta->unchanged(0, 0, w, h)) {
+        tree.reuse(delta->previous->tree, 0);
+        delta->tiles = delta->previous->tiles;
+        return tree;
+    }
+
+    SubtreeTasks tasks(pool ? SubtreeTasks::depthFor(*pool) : -1);
+    SubtreeTasks* deferred = pool ? &tasks : nullptr;
+    if (analysis == Analysis::Pyramid) {
+        BlockPyramid pyramid(*this, 3, splitLimitsRGB.minSplit, pool);
+        subdivideRGB(pyramid, 0, 0, 0, previous, tree, delta, deferred);
+        buildSubtrees(tree, tasks, pool, [&](const SubtreeTasks::Task& task, Quadtree& subtree) {
+            subdivideRGB(pyramid, task.depth, task.ix, task.iy, task.previous, subtree, delta);
+        });
+        return tree;
+    }
+
+    SummedAreaTable table = delta ? SummedAreaTable(*this, 3, true, *delta, pool) : SummedAreaTable(*this, 3, true, pool);
+    subdivideRGB(0, 0, w, h, 0, previous, table, tree, delta, deferred);
+    buildSubtrees(tree, tasks, pool, [&](const SubtreeTasks::Task& task, Quadtree& subtree) {
+        subdivideRGB(task.sx, task.sy, task.sw, task.sh, task.depth, task.previous, table, subtree, delta);
+    });
+    if (delta) delta->tiles = std::move(table.tiles);
 
-    std::tuple<bool, int, int, int> check = subdivideCheckRGB(sx, sy, sw, sh);
+    return tree;
+}
+
+void Image::subdivideRGB(uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh, int depth, int previous, const SummedAreaTable& table, Quadtree& tree, FrameDelta* delta, SubtreeTasks* tasks) {
+    if (previous >= 0 && delta->unchanged(sx, sy, sw, sh)) {
+        tree.reuse(delta->previous->tree, previous);
+        return;
+    }
+    if (tasks && depth == tasks->depth) {
+        tasks->defer(tree, sx, sy, sw, sh, depth, 0, 0, previous);
+        return;
+    }
+
+    std::tuple<bool, int, int, int> check = subdivideCheckRGB(table, sx, sy, sw, sh);
     bool quad = std::get<0>(check);
     int valR = std::get<1>(check);
     int valG = std::get<2>(check);
     int valB = std::get<3>(check);
+    size_t node = tree.add(sx, sy, sw, sh, depth, valR, valG, valB);
 
-    if ((!quad && sw > 8 && sh > 8) || (sw > 32 && sh > 32)) {
+    if ((!quad && sw > splitLimitsRGB.minSplit && sh > splitLimitsRGB.minSplit)
+        || (sw > splitLimitsRGB.maxLeaf && sh > splitLimitsRGB.maxLeaf)) {
         uint16_t sw_l, sw_r, sh_t, sh_b;
         if (sw % 2 == 0) {
             sw_l = sw/2;
@@ -334,68 +876,842 @@ void Image::subdivideRGB(uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh, Ima
             sh_t = floor(sh/2);
             sh_b = ceil(sh/2) + 1;
         }
-        subdivideRGB(sx, sy, sw_l, sh_t, frameRGB, resizedAmogi);
-        subdivideRGB(sx + sw_r, sy, sw_l, sh_t, frameRGB, resizedAmogi);
-        subdivideRGB(sx, sy + sh_b, sw_l, sh_t, frameRGB, resizedAmogi);
-        subdivideRGB(sx + sw_r, sy + sh_b, sw_l, sh_t, frameRGB, resizedAmogi);
+        const Quadtree* reference = delta && delta->previous ? &delta->previous->tree : nullptr;
+        subdivideRGB(sx, sy, sw_l, sh_t, depth + 1, Quadtree::child(reference, previous, 0), table, tree, delta, tasks);
+        subdivideRGB(sx + sw_r, sy, sw_l, sh_t, depth + 1, Quadtree::child(reference, previous, 1), table, tree, delta, tasks);
+        subdivideRGB(sx, sy + sh_b, sw_l, sh_t, depth + 1, Quadtree::child(reference, previous, 2), table, tree, delta, tasks);
+        subdivideRGB(sx + sw_r, sy + sh_b, sw_l, sh_t, depth + 1, Quadtree::child(reference, previous, 3), table, tree, delta, tasks);
     } else {
-        frameRGB.overlay(resizedAmogi[std::make_pair(sw, sh)].colorMaskNew(valR/255.f, valG/255.f, valB/255.f), sx, sy);
+        tree.nodes[node].flags = QuadNode::Leaf | QuadNode::Drawn;
     }
+    tree.nodes[node].end = tree.nodes.size();
 }
 
+void Image::subdivideRGB(const BlockPyramid& pyramid, int level, int ix, int iy, int previous, Quadtree& tree, FrameDelta* delta, SubtreeTasks* tasks) {
+    uint16_t sx = pyramid.xs[level][ix];
+    uint16_t sy = pyramid.ys[level][iy];
+    uint16_t sw = pyramid.ws[level];
+    uint16_t sh = pyramid.hs[level];
+    if (previous >= 0 && delta->unchanged(sx, sy, sw, sh)) {
+        tree.reuse(delta->previous->tree, previous);
+        return;
+    }
+    if (tasks && level == tasks->depth) {
+        tasks->defer(tree, sx, sy, sw, sh, level, ix, iy, previous);
+        return;
+    }
+
+    bool quad = pyramid.uniform(level, ix, iy);
+    size_t node = tree.add(sx, sy, sw, sh, level, pyramid.mean(level, ix, iy, 0), pyramid.mean(level, ix, iy, 1), pyramid.mean(level, ix, iy, 2));
+
+    if ((!quad && sw > splitLimitsRGB.minSplit && sh > splitLimitsRGB.minSplit)
+        || (sw > splitLimitsRGB.maxLeaf && sh > splitLimitsRGB.maxLeaf)) {
+        const Quadtree* reference = delta && delta->previous ? &delta->previous->tree : nullptr;
+        subdivideRGB(pyramid, level + 1, ix*2, iy*2, Quadtree::child(reference, previous, 0), tree, delta, tasks);
+        subdivideRGB(pyramid, level + 1, ix*2 + 1, iy*2, Quadtree::child(reference, previous, 1), tree, delta, tasks);
+        subdivideRGB(pyramid, level + 1, ix*2, iy*2 + 1, Quadtree::child(reference, previous, 2), tree, delta, tasks);
+        subdivideRGB(pyramid, level + 1, ix*2 + 1, iy*2 + 1, Quadtree::child(reference, previous, 3), tree, delta, tasks);
+    } else {
+        tree.nodes[node].flags = QuadNode::Leaf | QuadNode::Drawn;
+    }
+    tree.nodes[node].end = tree.nodes.size();
+}
+
+// gray (with or without alpha) is spread to all three channels like in the summed-area table
 std::tuple<bool, int, int, int> Image::subdivideCheckRGB(uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh) {
-    bool quad = true;
-    uint8_t colR = data.at((sx + sy * w) * channels);
-    uint8_t colG = data.at((sx + sy * w) * channels + 1);
-    uint8_t colB = data.at((sx + sy * w) * channels + 2);
     int sumR = 0;
     int sumG = 0;
     int sumB = 0;
+    int differs = 0;
+
+    withChannels(channels, [&](auto c) {
+        const int stride = c ? c : channels;
+        const int g = stride < 3 ? 0 : 1;
+        const int b = stride < 3 ? 0 : 2;
+        const uint8_t* first = data.data() + ((size_t)sy * w + sx) * stride;
+        for (uint16_t y = sy; y < sh + sy; y++) {
+            const uint8_t* pixel = data.data() + ((size_t)y * w + sx) * stride;
+            for (uint16_t x = 0; x < sw; x++, pixel += stride) {
+                sumR += pixel[0];
+                sumG += pixel[g];
+                sumB += pixel[b];
+                differs |= (pixel[0] ^ first[0]) | (pixel[g] ^ first[g]) | (pixel[b] ^ first[b]);
+            }
+        }
+    });
 
-    for (uint16_t y = sy; y < sh + sy; y++) {
-        for (uint16_t x = sx; x < sw + sx; x++) {
-            uint8_t pixR = data.at((x + y * w) * channels);
-            sumR += pixR;
-            if (colR != pixR) quad = false;
-            uint8_t pixG = data.at((x + y * w) * channels + 1);
-            sumG += pixG;
-            if (colG != pixG) quad = false;
-            uint8_t pixB = data.at((x + y * w) * channels + 2);
-            sumB += pixB;
-            if (colB != pixB) quad = false;
+    return std::make_tuple(differs == 0, (int)sumR/(sh*sw), (int)sumG/(sh*sw), (int)sumB/(sh*sw));
+}
+
+// a block is uniform iff every channel sum divides evenly and the squares add up to exactly n * mean^2
+std::tuple<bool, int, int, int> Image::subdivideCheckRGB(const SummedAreaTable& table, uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh) const {
+    uint64_t n = (uint64_t)sw * sh;
+    uint64_t sums[3];
+    uint64_t squares;
+    table.blockSums(sx, sy, sw, sh, sums, &squares);
+    uint64_t sumR = sums[0];
+    uint64_t sumG = sums[1];
+    uint64_t sumB = sums[2];
+    uint64_t valR = sumR / n;
+    uint64_t valG = sumG / n;
+    uint64_t valB = sumB / n;
+
+    bool quad = sumR % n == 0 && sumG % n == 0 && sumB % n == 0
+        && squares == n * (valR*valR + valG*valG + valB*valB);
+
+    return std::make_tuple(quad, (int)valR, (int)valG, (int)valB);
+}
+
+// the pixels of one image row summed along it and added onto the table row above, for T table channels out of C
+// image channels (0: the runtime count), the squares only when rowSq is given
+template <int T, int C>
+static void sumTableRow(const uint8_t* src, int w, int channels, int imgChannels, const uint64_t* above, uint64_t* row, const uint64_t* aboveSq, uint64_t* rowSq) {
+    const int tc = T ? T : std::min(channels, 4); // tables have 1 or 3
+    const int ic = C ? C : imgChannels;
+    uint64_t rowSum[4] = {0, 0, 0, 0};
+    uint64_t rowSumSq = 0;
+    for (int x = 0; x < w; x++, src += ic, above += tc, row += tc) {
+        for (int channel = 0; channel < tc; channel++) {
+            uint8_t pix = src[ic < 3 ? 0 : channel];
+            rowSum[channel] += pix;
+            rowSumSq += pix * pix;
+            row[channel] = above[channel] + rowSum[channel];
         }
+        if (rowSq) rowSq[x] = aboveSq[x] + rowSumSq;
     }
+}
 
-    return std::make_tuple(quad, (int)sumR/(sh*sw), (int)sumG/(sh*sw), (int)sumB/(sh*sw));
+SummedAreaTable::SummedAreaTable(const Image& img, int channels, bool squares, work_stealing_pool* pool) : w(img.w), h(img.h), channels(channels) {
+    size_t stride = w + 1;
+    sum = std::vector<uint64_t>(stride * (h + 1) * channels);
+    if (squares) sumSq = std::vector<uint64_t>(stride * (h + 1));
+
+    // the row kernel for these channel counts is picked once for the whole table
+    void (*kernel)(const uint8_t*, int, int, int, const uint64_t*, uint64_t*, const uint64_t*, uint64_t*) = nullptr;
+    withChannels(channels, [&](auto t) {
+        withChannels(img.channels, [&](auto c) { kernel = sumTableRow<decltype(t)::value, decltype(c)::value>; });
+    });
+
+    // table row y + 1 from the pixels of row y added onto table row `above`
+    auto sumRow = [&](int y, int above) {
+        kernel(img.data.data() + (size_t)y * w * img.channels, w, channels, img.channels,
+               sum.data() + ((above * stride) + 1) * channels, sum.data() + (((y + 1) * stride) + 1) * channels,
+               squares ? sumSq.data() + above * stride + 1 : nullptr, squares ? sumSq.data() + (y + 1) * stride + 1 : nullptr);
+    };
+    if (pool == nullptr || h < 2) {
+        for (int y = 0; y < h; y++) {
+            sumRow(y, y);
+        }
+        return;
+    }
+
+    // every row on its own onto the zero row, then the rows are added up downwards in strips of columns
+    pool->parallelize_loop(0, h - 1, [&](int y) { sumRow(y, 0); });
+    size_t strips = std::min(stride, (size_t)pool->get_thread_count() * 4);
+    pool->parallelize_loop((size_t)0, strips - 1, [&](size_t strip) {
+        size_t x0 = stride * strip / strips;
+        size_t x1 = stride * (strip + 1) / strips;
+        for (int y = 2; y <= h; y++) {
+            uint64_t* row = sum.data() + y * stride * channels;
+            const uint64_t* above = row - stride * channels;
+            for (size_t x = x0 * channels; x < x1 * channels; x++) {
+                row[x] += above[x];
+            }
+            if (squares) {
+                for (size_t x = x0; x < x1; x++) {
+                    sumSq[y * stride + x] += sumSq[(y - 1) * stride + x];
+                }
+            }
+        }
+    }, strips);
 }
 
+SummedAreaTable::SummedAreaTable(const Image& img, int channels, bool squares, const FrameDelta& delta, work_stealing_pool* pool)
+    : w(img.w), h(img.h), channels(channels), tile(delta.tile), cols(delta.cols), rows(delta.rows), img(&img) {
+    size_t stride = channels + 1;
+    size_t count = (size_t)cols * rows * stride;
+    bool previous = delta.previous != nullptr && delta.previous->tiles.size() == count;
+    tiles = previous ? delta.previous->tiles : std::vector<uint64_t>(count);
+
+    auto sumTiles = [&](int ty) {
+        for (int tx = 0; tx < cols; tx++) {
+            if (previous && !delta.changed(tx, ty, tx + 1, ty + 1)) continue;
+            uint64_t* entry = tiles.data() + ((size_t)ty * cols + tx) * stride;
+            std::fill(entry, entry + stride, 0);
+            addPixels(tx * tile, ty * tile, std::min((tx + 1) * tile, w), std::min((ty + 1) * tile, h), entry, squares ? entry + channels : nullptr);
+        }
+    };
+    if (pool && rows > 0) {
+        pool->parallelize_loop(0, rows - 1, sumTiles);
+    } else {
+        for (int ty = 0; ty < rows; ty++) {
+            sumTiles(ty);
+        }
+    }
 
-void Image::subdivideValues(int sx, int sy, int sw, int sh, std::map<std::pair<int, int>, Image>& image_map) {
-    if (sw > 4 && sh > 4) {
-        int sw_l, sw_r, sh_t, sh_b;
-        if (sw % 2 == 0) {
-            sw_l = sw/2;
-        } else {
-            sw_l = floor(sw/2);
+    size_t integralStride = cols + 1;
+    sum = std::vector<uint64_t>(integralStride * (rows + 1) * channels);
+    if (squares) sumSq = std::vector<uint64_t>(integralStride * (rows + 1));
+    for (int ty = 0; ty < rows; ty++) {
+        for (int channel = 0; channel <= channels; channel++) {
+            if (channel == channels && !squares) break;
+            uint64_t rowSum = 0;
+            for (int tx = 0; tx < cols; tx++) {
+                rowSum += tiles[((size_t)ty * cols + tx) * stride + channel];
+                if (channel == channels) {
+                    sumSq[(ty + 1) * integralStride + tx + 1] = sumSq[ty * integralStride + tx + 1] + rowSum;
+                } else {
+                    sum[((ty + 1) * integralStride + tx + 1) * channels + channel] = sum[(ty * integralStride + tx + 1) * channels + channel] + rowSum;
+                }
+            }
         }
-        if (sh % 2 == 0) { 
-            sh_t = sh/2;
-        } else {
-            sh_t = floor(sh/2);
+    }
+}
+
+// sums of the pixels in [x0, x1) x [y0, y1) added onto sums / squares
+void SummedAreaTable::addPixels(int x0, int y0, int x1, int y1, uint64_t* sums, uint64_t* squares) const {
+    withChannels(channels, [&](auto t) {
+        withChannels(img->channels, [&](auto c) {
+            const int tc = t ? t : channels;
+            const int ic = c ? c : img->channels;
+            for (int y = y0; y < y1; y++) {
+                const uint8_t* src = img->data.data() + ((size_t)y * w + x0) * ic;
+                for (int x = x0; x < x1; x++, src += ic) {
+                    for (int channel = 0; channel < tc; channel++) {
+                        uint8_t pix = src[ic < 3 ? 0 : channel];
+                        sums[channel] += pix;
+                        if (squares) *squares += pix * pix;
+                    }
+                }
+            }
+        });
+    });
+}
+
+void SummedAreaTable::blockSums(uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh, uint64_t* sums, uint64_t* squares) const {
+    if (tile == 1) {
+        for (int channel = 0; channel < channels; channel++) {
+            sums[channel] = blockSum(channel, sx, sy, sw, sh);
+        }
+        if (squares) *squares = blockSumSq(sx, sy, sw, sh);
+        return;
+    }
+
+    std::fill(sums, sums + channels, 0);
+    if (squares) *squares = 0;
+
+    // whole tiles from the integral, the rest of the block pixel by pixel
+    int tx0 = (sx + tile - 1) / tile;
+    int ty0 = (sy + tile - 1) / tile;
+    int tx1 = (sx + sw) / tile;
+    int ty1 = (sy + sh) / tile;
+    if (tx0 >= tx1 || ty0 >= ty1) {
+        addPixels(sx, sy, sx + sw, sy + sh, sums, squares);
+        return;
+    }
+
+    size_t stride = cols + 1;
+    size_t top = ty0 * stride;
+    size_t bottom = ty1 * stride;
+    for (int channel = 0; channel < channels; channel++) {
+        sums[channel] = sum[(bottom + tx1) * channels + channel] - sum[(top + tx1) * channels + channel]
+                      - sum[(bottom + tx0) * channels + channel] + sum[(top + tx0) * channels + channel];
+    }
+    if (squares) *squares = sumSq[bottom + tx1] - sumSq[top + tx1] - sumSq[bottom + tx0] + sumSq[top + tx0];
+
+    addPixels(sx, sy, sx + sw, ty0 * tile, sums, squares);
+    addPixels(sx, ty0 * tile, tx0 * tile, ty1 * tile, sums, squares);
+    addPixels(tx1 * tile, ty0 * tile, sx + sw, ty1 * tile, sums, squares);
+    addPixels(sx, ty1 * tile, sx + sw, sy + sh, sums, squares);
+}
+
+uint64_t SummedAreaTable::blockSum(int channel, uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh) const {
+    if (tile > 1) {
+        uint64_t sums[3];
+        blockSums(sx, sy, sw, sh, sums, nullptr);
+        return sums[channel];
+    }
+    size_t stride = w + 1;
+    size_t top = sy * stride;
+    size_t bottom = (sy + sh) * stride;
+    return sum[(bottom + sx + sw) * channels + channel] - sum[(top + sx + sw) * channels + channel]
+         - sum[(bottom + sx) * channels + channel] + sum[(top + sx) * channels + channel];
+}
+
+uint64_t SummedAreaTable::blockSumSq(uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh) const {
+    if (tile > 1) {
+        uint64_t sums[3];
+        uint64_t squares;
+        blockSums(sx, sy, sw, sh, sums, &squares);
+        return squares;
+    }
+    size_t stride = w + 1;
+    size_t top = sy * stride;
+    size_t bottom = (sy + sh) * stride;
+    return sumSq[bottom + sx + sw] - sumSq[top + sx + sw] - sumSq[bottom + sx] + sumSq[top + sx];
+}
+
+void BlockStats::add(const BlockStats& other) {
+    for (int channel = 0; channel < 3; channel++) {
+        sum[channel] += other.sum[channel];
+        sumSq[channel] += other.sumSq[channel];
+        if (other.min[channel] < min[channel]) min[channel] = other.min[channel];
+        if (other.max[channel] > max[channel]) max[channel] = other.max[channel];
+    }
+}
+
+BlockPyramid::BlockPyramid(const Image& img, int channels, uint16_t minSize, work_stealing_pool* pool) : channels(channels) {
+    xs.push_back({0});
+    ys.push_back({0});
+    ws.push_back(img.w);
+    hs.push_back(img.h);
+
+    // children are always (sw/2, sh/2), the right/bottom ones start at sw - sw/2 (see subdivideBW)
+    while (ws.back() > minSize && hs.back() > minSize) {
+        uint16_t sw = ws.back();
+        uint16_t sh = hs.back();
+        std::vector<uint16_t> nextXs;
+        std::vector<uint16_t> nextYs;
+        for (uint16_t x : xs.back()) {
+            nextXs.push_back(x);
+            nextXs.push_back(x + sw - sw/2);
+        }
+        for (uint16_t y : ys.back()) {
+            nextYs.push_back(y);
+            nextYs.push_back(y + sh - sh/2);
+        }
+        xs.push_back(nextXs);
+        ys.push_back(nextYs);
+        ws.push_back(sw/2);
+        hs.push_back(sh/2);
+    }
+
+    int maxLevel = (int)ws.size() - 1;
+    levels.resize(maxLevel + 1);
+    for (int level = 0; level <= maxLevel; level++) {
+        levels[level].resize((size_t)1 << (2*level));
+    }
+
+    // deepest level and column/row index covering each pixel column/row
+    std::vector<uint8_t> depthX(img.w, 0);
+    std::vector<uint8_t> depthY(img.h, 0);
+    std::vector<uint32_t> colX(img.w, 0);
+    std::vector<uint32_t> rowY(img.h, 0);
+    for (int level = 1; level <= maxLevel; level++) {
+        for (size_t i = 0; i < xs[level].size(); i++) {
+            for (int x = xs[level][i]; x < xs[level][i] + ws[level]; x++) {
+                depthX[x] = level;
+                colX[x] = i;
+            }
+        }
+        for (size_t i = 0; i < ys[level].size(); i++) {
+            for (int y = ys[level][i]; y < ys[level][i] + hs[level]; y++) {
+                depthY[y] = level;
+                rowY[y] = i;
+            }
+        }
+    }
+
+    auto addPixel = [&](int x, int y) {
+        const uint8_t* src = img.data.data() + ((size_t)y * img.w + x) * img.channels;
+        int level = std::min(depthX[x], depthY[y]);
+        size_t ix = colX[x] >> (depthX[x] - level);
+        size_t iy = rowY[y] >> (depthY[y] - level);
+        BlockStats& stats = levels[level][(iy << level) + ix];
+        for (int channel = 0; channel < channels; channel++) {
+            uint8_t pix = src[img.channels < 3 ? 0 : channel];
+            stats.sum[channel] += pix;
+            stats.sumSq[channel] += pix * pix;
+            if (pix < stats.min[channel]) stats.min[channel] = pix;
+            if (pix > stats.max[channel]) stats.max[channel] = pix;
+        }
+    };
+    if (pool == nullptr) {
+        for (int y = 0; y < img.h; y++) {
+            for (int x = 0; x < img.w; x++) {
+                addPixel(x, y);
+            }
+        }
+    } else {
+        // bands of rows by the block row they're in at level `band`, a block at that level or deeper only gets
+        // pixels from its own band, the pixels of coarser blocks (on gap rows / columns between blocks) come after
+        int band = std::min(maxLevel, SubtreeTasks::depthFor(*pool));
+        std::vector<std::vector<int>> bands((size_t)1 << band);
+        std::vector<int> gapRows;
+        std::vector<int> gapColumns;
+        for (int y = 0; y < img.h; y++) {
+            if (depthY[y] >= band) bands[rowY[y] >> (depthY[y] - band)].push_back(y);
+            else gapRows.push_back(y);
+        }
+        for (int x = 0; x < img.w; x++) {
+            if (depthX[x] < band) gapColumns.push_back(x);
+        }
+        pool->parallelize_loop((size_t)0, bands.size() - 1, [&](size_t b) {
+            for (int y : bands[b]) {
+                for (int x = 0; x < img.w; x++) {
+                    if (depthX[x] >= band) addPixel(x, y);
+                }
+            }
+        }, bands.size());
+        for (int y : gapRows) {
+            for (int x = 0; x < img.w; x++) {
+                addPixel(x, y);
+            }
+        }
+        for (const std::vector<int>& rows : bands) {
+            for (int y : rows) {
+                for (int x : gapColumns) {
+                    addPixel(x, y);
+                }
+            }
         }
-        subdivideValues(sx, sy, sw_l, sh_t, image_map);
     }
 
-    if (image_map.count(std::make_pair(sw, sh)) == 0) {
-        image_map[std::make_pair(sw, sh)] = resizeFastNew(sw, sh);
-        // std::cout<<sw<<" "<<sh<<" : "<<image_map.count(std::make_pair(sw, sh))<<" "<<image_map.size()<<"\n";
+    for (int level = maxLevel - 1; level >= 0; level--) {
+        size_t side = (size_t)1 << level;
+        for (size_t iy = 0; iy < side; iy++) {
+            for (size_t ix = 0; ix < side; ix++) {
+                BlockStats& stats = levels[level][iy * side + ix];
+                const BlockStats* children = levels[level + 1].data();
+                stats.add(children[(iy*2) * side*2 + ix*2]);
+                stats.add(children[(iy*2) * side*2 + ix*2 + 1]);
+                stats.add(children[(iy*2 + 1) * side*2 + ix*2]);
+                stats.add(children[(iy*2 + 1) * side*2 + ix*2 + 1]);
+            }
+        }
     }
 }
 
-std::map<std::pair<int, int>, Image> Image::preloadResized(int sw, int sh) {
-    std::map<std::pair<int, int>, Image> image_map;
+int BlockPyramid::mean(int level, int ix, int iy, int channel) const {
+    return (int)(at(level, ix, iy).sum[channel] / pixels(level));
+}
+
+double BlockPyramid::variance(int level, int ix, int iy, int channel) const {
+    const BlockStats& stats = at(level, ix, iy);
+    double n = (double)pixels(level);
+    double mean = stats.sum[channel] / n;
+    return stats.sumSq[channel] / n - mean * mean;
+}
 
-    subdivideValues(0, 0, sw, sh, image_map);
+bool BlockPyramid::uniform(int level, int ix, int iy) const {
+    const BlockStats& stats = at(level, ix, iy);
+    for (int channel = 0; channel < channels; channel++) {
+        if (stats.min[channel] != stats.max[channel]) return false;
+    }
+    return true;
+}
 
-    return image_map;
+TintCache::TintCache(size_t capacity) : capacity(capacity) {}
+
+const Image& TintCache::get(const Sprite& sprite, uint8_t r, uint8_t g, uint8_t b) {
+    Key key = std::make_tuple(sprite.data, r, g, b);
+    auto found = index.find(key);
+    if (found != index.end()) {
+        entries.splice(entries.begin(), entries, found->second);
+        return found->second->second;
+    }
+
+    if (entries.size() >= capacity && !entries.empty()) {
+        index.erase(entries.back().first);
+        entries.pop_back();
+    }
+    // tinted exactly like the blend kernels tint on the fly
+    Image tinted(sprite.w, sprite.h, sprite.channels);
+    std::copy(sprite.data, sprite.data + tinted.size, tinted.data.begin());
+    tintPixels(tinted.data.data(), (size_t)tinted.w * tinted.h, tinted.channels, r, g, b);
+    entries.emplace_front(key, tinted);
+    index[key] = entries.begin();
+    return entries.front().second;
+}
+
+FrameDelta::FrameDelta(const Image& current, const QuadifiedFrame* previous, int tile)
+    : previous(previous), w(current.w), tile(tile), cols((current.w + tile - 1) / tile), rows((current.h + tile - 1) / tile) {
+    dirty = std::vector<uint32_t>((size_t)(cols + 1) * (rows + 1));
+    bool comparable = previous != nullptr && current.w == previous->input.w && current.h == previous->input.h
+        && current.channels == previous->input.channels && previous->tree.w == current.w && previous->tree.h == current.h && !previous->tree.nodes.empty();
+    if (!comparable) this->previous = nullptr;
+
+    std::vector<uint8_t> tileRow(cols);
+    size_t stride = (size_t)current.w * current.channels;
+    for (int ty = 0; ty < rows; ty++) {
+        std::fill(tileRow.begin(), tileRow.end(), !comparable);
+        for (int y = ty * tile; comparable && y < std::min((ty + 1) * tile, current.h); y++) {
+            const uint8_t* now = current.data.data() + y * stride;
+            const uint8_t* before = previous->input.data.data() + y * stride;
+            for (int tx = 0; tx < cols; tx++) {
+                if (tileRow[tx]) continue;
+                size_t begin = (size_t)tx * tile * current.channels;
+                size_t length = (size_t)(std::min((tx + 1) * tile, current.w) - tx * tile) * current.channels;
+                tileRow[tx] = memcmp(now + begin, before + begin, length) != 0;
+            }
+        }
+        uint32_t rowSum = 0;
+        for (int tx = 0; tx < cols; tx++) {
+            rowSum += tileRow[tx];
+            dirty[(size_t)(ty + 1) * (cols + 1) + tx + 1] = dirty[(size_t)ty * (cols + 1) + tx + 1] + rowSum;
+        }
+    }
+}
+
+bool FrameDelta::changed(int tx0, int ty0, int tx1, int ty1) const {
+    size_t stride = cols + 1;
+    return dirty[ty1 * stride + tx1] - dirty[ty0 * stride + tx1] - dirty[ty1 * stride + tx0] + dirty[ty0 * stride + tx0] != 0;
+}
+
+bool FrameDelta::unchanged(uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh) const {
+    if (previous == nullptr || sw == 0 || sh == 0) return false;
+    return !changed(sx / tile, sy / tile, (sx + sw - 1) / tile + 1, (sy + sh - 1) / tile + 1);
+}
+
+SpriteAtlas::SpriteAtlas(const std::vector<Image>& frames, const std::vector<std::pair<int, int>>& sizes, thread_pool& pool, SpriteFilter filter)
+    : frameCount(frames.size()) {
+    std::vector<int> widths;
+    std::vector<int> heights;
+    for (const auto& [w, h] : sizes) {
+        widths.push_back(w);
+        heights.push_back(h);
+    }
+    std::sort(widths.begin(), widths.end());
+    widths.erase(std::unique(widths.begin(), widths.end()), widths.end());
+    std::sort(heights.begin(), heights.end());
+    heights.erase(std::unique(heights.begin(), heights.end()), heights.end());
+
+    columnCount = widths.size();
+    rowCount = heights.size();
+    columns.assign(widths.empty() ? 0 : widths.back() + 1, -1);
+    rows.assign(heights.empty() ? 0 : heights.back() + 1, -1);
+    for (size_t i = 0; i < columnCount; i++) columns[widths[i]] = i;
+    for (size_t i = 0; i < rowCount; i++) rows[heights[i]] = i;
+    grid.assign((size_t)frameCount * rowCount * columnCount, -1);
+
+    // lay every copy out first, then resize them all at once straight into their place
+    std::vector<int> entryFrames;
+    size_t offset = 0;
+    for (int frame = 0; frame < frameCount; frame++) {
+        const Image& sprite = frames[frame];
+        if (sprite.w <= 0 || sprite.h <= 0 || sprite.data.size() < (size_t)sprite.w * sprite.h * sprite.channels) continue;
+        for (const auto& [w, h] : sizes) {
+            if (w <= 0 || h <= 0 || grid[((size_t)frame * rowCount + rows[h]) * columnCount + columns[w]] >= 0) continue;
+            grid[((size_t)frame * rowCount + rows[h]) * columnCount + columns[w]] = entries.size();
+            entries.push_back(Entry{offset, (uint16_t)w, (uint16_t)h, (uint8_t)sprite.channels, {}});
+            entryFrames.push_back(frame);
+            offset += ((size_t)w * h * sprite.channels + 63) / 64 * 64;
+        }
+    }
+
+    // padded so the first copy can start on a cache line wherever the buffer lands
+    uint8_t* buffer = new uint8_t[offset + 63]();
+    storage.reset(buffer, [](const uint8_t* bytes) { delete[] bytes; });
+    uint8_t* base = buffer + (64 - (uintptr_t)buffer % 64) % 64;
+    pixels = base;
+    pixelBytes = offset;
+    if (entries.empty()) return;
+    if (filter == SpriteFilter::Nearest) {
+        pool.parallelize_loop((size_t)0, entries.size() - 1, [&](size_t i) {
+            frames[entryFrames[i]].resizeInto(base + entries[i].offset, entries[i].w, entries[i].h);
+        });
+        return;
+    }
+
+    // every copy is filtered from the smallest mip level that is still at least as big
+    std::vector<std::vector<Image>> mips(frameCount);
+    pool.parallelize_loop(0, frameCount - 1, [&](int frame) {
+        if (frames[frame].w > 0 && frames[frame].h > 0) mips[frame] = frames[frame].mipChain();
+    });
+    pool.parallelize_loop((size_t)0, entries.size() - 1, [&](size_t i) {
+        const std::vector<Image>& levels = mips[entryFrames[i]];
+        size_t level = 0;
+        while (level + 1 < levels.size() && levels[level + 1].w >= entries[i].w && levels[level + 1].h >= entries[i].h) level++;
+        levels[level].resizeAreaInto(base + entries[i].offset, entries[i].w, entries[i].h);
+    });
+}
+
+// the whole file mapped read only, unmapped again when the last copy of the pointer goes
+// an atlas that's renamed over it meanwhile doesn't change what's mapped
+static std::shared_ptr<const uint8_t> mapFile(const std::string& path, size_t& length) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return nullptr;
+    LARGE_INTEGER size;
+    HANDLE mapping = nullptr;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    }
+    CloseHandle(file);
+    if (mapping == nullptr) return nullptr;
+    void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (view == nullptr) return nullptr;
+    length = size.QuadPart;
+    return std::shared_ptr<const uint8_t>((const uint8_t*)view, [](const uint8_t* bytes) { UnmapViewOfFile(bytes); });
+#else
+    int file = open(path.c_str(), O_RDONLY);
+    if (file < 0) return nullptr;
+    struct stat info;
+    void* view = MAP_FAILED;
+    if (fstat(file, &info) == 0 && info.st_size > 0) {
+        view = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    }
+    close(file);
+    if (view == MAP_FAILED) return nullptr;
+    length = info.st_size;
+    return std::shared_ptr<const uint8_t>((const uint8_t*)view, [length](const uint8_t* bytes) { munmap((void*)bytes, length); });
+#endif
+}
+
+// layout and copies are in native byte order, it's a cache for the machine that wrote it
+// byteOrder and entrySize turn away a file from a machine that lays them out differently
+struct AtlasFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t entrySize;
+    uint64_t frameCount;
+    uint64_t columnCount;
+    uint64_t rowCount;
+    uint64_t columns; // element counts of the arrays that follow the header in this order
+    uint64_t rows;
+    uint64_t grid;
+    uint64_t entries;
+    uint64_t pixelOffset; // page aligned
+    uint64_t pixelBytes;
+};
+
+static_assert(sizeof(SpriteAtlas::Entry) == sizeof(size_t) + 8, "Entry has padding that save() would write uninitialized");
+
+static const uint32_t atlasFileVersion = 2;
+static const uint64_t atlasFilePage = 4096;
+
+// written to a temporary file that's renamed into place, so a concurrent run never loads half of it
+bool SpriteAtlas::save(const std::string& path) const {
+    AtlasFileHeader header = {{'Q', 'S', 'A', 'T'}, atlasFileVersion, 0x01020304, sizeof(Entry),
+                              (uint64_t)frameCount, columnCount, rowCount, columns.size(), rows.size(), grid.size(), entries.size(), 0, pixelBytes};
+    uint64_t layout = sizeof(header) + (columns.size() + rows.size() + grid.size()) * sizeof(int32_t) + entries.size() * sizeof(Entry);
+    header.pixelOffset = (layout + atlasFilePage - 1) / atlasFilePage * atlasFilePage;
+
+    std::string temporary = path + ".tmp" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+    std::ofstream out(temporary, std::ios::binary);
+    auto put = [&](const void* bytes, size_t length) { out.write((const char*)bytes, length); };
+    put(&header, sizeof(header));
+    put(columns.data(), columns.size() * sizeof(int32_t));
+    put(rows.data(), rows.size() * sizeof(int32_t));
+    put(grid.data(), grid.size() * sizeof(int32_t));
+    put(entries.data(), entries.size() * sizeof(Entry));
+    std::vector<uint8_t> padding(header.pixelOffset - layout);
+    put(padding.data(), padding.size());
+    put(pixels, pixelBytes);
+    out.close();
+
+    std::error_code error;
+    if (out) std::filesystem::rename(temporary, path, error);
+    if (!out || error) {
+        std::filesystem::remove(temporary, error);
+        return false;
+    }
+    return true;
+}
+
+// the layout is copied out, the copies are drawn from the mapped file itself
+bool SpriteAtlas::load(const std::string& path) {
+    size_t length = 0;
+    std::shared_ptr<const uint8_t> file = mapFile(path, length);
+    AtlasFileHeader header;
+    if (file == nullptr || length < sizeof(header)) return false;
+    memcpy(&header, file.get(), sizeof(header));
+    if (std::string(header.magic, 4) != "QSAT" || header.version != atlasFileVersion
+        || header.byteOrder != 0x01020304 || header.entrySize != sizeof(Entry)) {
+        return false;
+    }
+
+    const uint8_t* pos = file.get() + sizeof(header);
+    size_t left = length - sizeof(header);
+    auto getVector = [&](auto& values, uint64_t count) {
+        if (count > left / sizeof(values[0])) return false;
+        values.resize(count);
+        memcpy(values.data(), pos, count * sizeof(values[0]));
+        pos += count * sizeof(values[0]);
+        left -= count * sizeof(values[0]);
+        return true;
+    };
+    if (!getVector(columns, header.columns) || !getVector(rows, header.rows) || !getVector(grid, header.grid) || !getVector(entries, header.entries)) {
+        return false;
+    }
+    if (header.pixelOffset % atlasFilePage != 0 || header.pixelOffset > length || header.pixelBytes > length - header.pixelOffset) return false;
+    frameCount = header.frameCount;
+    columnCount = header.columnCount;
+    rowCount = header.rowCount;
+    pixels = file.get() + header.pixelOffset;
+    pixelBytes = header.pixelBytes;
+    storage = file;
+
+    // a file from something else would otherwise index out of bounds
+    if (header.frameCount > INT32_MAX || grid.size() != (size_t)frameCount * rowCount * columnCount) return false;
+    for (const Entry& entry : entries) {
+        if (entry.offset > pixelBytes || (size_t)entry.w * entry.h * entry.channels > pixelBytes - entry.offset) return false;
+    }
+    for (int32_t entry : grid) {
+        if (entry >= (int32_t)entries.size()) return false;
+    }
+    for (int32_t column : columns) {
+        if (column >= (int32_t)columnCount) return false;
+    }
+    for (int32_t row : rows) {
+        if (row >= (int32_t)rowCount) return false;
+    }
+    return true;
+}
+
+Sprite SpriteAtlas::sprite(int frame, int w, int h) const {
+    if (frame < 0 || frame >= frameCount || w < 0 || h < 0 || w >= (int)columns.size() || h >= (int)rows.size()) return Sprite();
+    if (columns[w] < 0 || rows[h] < 0) return Sprite();
+    int32_t entry = grid[((size_t)frame * rowCount + rows[h]) * columnCount + columns[w]];
+    if (entry < 0) return Sprite();
+
+    const Entry& found = entries[entry];
+    return Sprite(pixels + found.offset, found.w, found.h, found.channels);
+}
+
+Quadtree::Quadtree(int w, int h) : w(w), h(h) {}
+
+size_t Quadtree::add(uint16_t x, uint16_t y, uint16_t w, uint16_t h, int depth, uint8_t r, uint8_t g, uint8_t b) {
+    nodes.push_back(QuadNode{x, y, w, h, r, g, b, (uint8_t)depth, 0, (uint32_t)nodes.size() + 1});
+    return nodes.size() - 1;
+}
+
+int Quadtree::child(const Quadtree* tree, int node, int k) {
+    if (tree == nullptr || node < 0 || (tree->nodes[node].flags & QuadNode::Leaf)) return -1;
+    int child = node + 1;
+    for (int i = 0; i < k; i++) {
+        child = tree->nodes[child].end;
+    }
+    return child;
+}
+
+// the subtree is copied as it is, its root marked so the renderer copies its pixels instead of drawing it again
+void Quadtree::reuse(const Quadtree& other, int node) {
+    size_t offset = nodes.size();
+    int64_t shift = (int64_t)offset - node;
+    for (uint32_t i = node; i < other.nodes[node].end; i++) {
+        nodes.push_back(other.nodes[i]);
+        nodes.back().end += shift;
+        nodes.back().flags &= ~QuadNode::Reused;
+    }
+    nodes[offset].flags |= QuadNode::Reused;
+}
+
+size_t Quadtree::leaves() const {
+    size_t count = 0;
+    for (const QuadNode& node : nodes) {
+        if (node.flags & QuadNode::Leaf) count++;
+    }
+    return count;
+}
+
+int Quadtree::maxDepth() const {
+    int deepest = 0;
+    for (const QuadNode& node : nodes) {
+        deepest = std::max(deepest, (int)node.depth);
+    }
+    return deepest;
+}
+
+// edges are scaled and rounded down, so blocks that touched still touch and a block keeps one of two sizes per level
+// blocks that shrink to nothing aren't drawn
+Quadtree Quadtree::scaled(int targetW, int targetH) const {
+    if (targetW == w && targetH == h) return *this;
+    Quadtree tree(targetW, targetH);
+    tree.nodes = nodes;
+    for (QuadNode& node : tree.nodes) {
+        uint16_t x0 = (int64_t)node.x * targetW / w;
+        uint16_t y0 = (int64_t)node.y * targetH / h;
+        uint16_t x1 = (int64_t)(node.x + node.w) * targetW / w;
+        uint16_t y1 = (int64_t)(node.y + node.h) * targetH / h;
+        node.x = x0;
+        node.y = y0;
+        node.w = x1 - x0;
+        node.h = y1 - y0;
+        if (node.w == 0 || node.h == 0) node.flags &= ~QuadNode::Drawn;
+    }
+    return tree;
+}
+
+Image Quadtree::render(const SpriteAtlas& sprites, int frameIndex, TintCache* tintCache, const Image* reference, work_stealing_pool* pool) const {
+    Image frame(w, h, 3);
+    if (reference && (reference->w != w || reference->h != h)) reference = nullptr;
+    auto draw = [&](size_t first, size_t last, TintCache* tints) {
+        for (size_t i = first; i < last; i++) {
+            const QuadNode& node = nodes[i];
+            if ((node.flags & QuadNode::Reused) && reference) {
+                for (int y = node.y; y < node.y + node.h; y++) {
+                    size_t offset = ((size_t)y * w + node.x) * 3;
+                    memcpy(frame.data.data() + offset, reference->data.data() + offset, (size_t)node.w * 3);
+                }
+                i = node.end - 1;
+                continue;
+            }
+            if (!(node.flags & QuadNode::Drawn)) continue;
+
+            Sprite sprite = sprites.sprite(frameIndex, node.w, node.h);
+            if (sprite.data == nullptr) continue;
+            if (tints) {
+                frame.overlay(tints->get(sprite, node.r, node.g, node.b), node.x, node.y);
+            } else {
+                frame.overlay(sprite, node.x, node.y, node.r/255.f, node.g/255.f, node.b/255.f);
+            }
+        }
+    };
+    if (pool == nullptr) {
+        draw(0, nodes.size(), tintCache);
+        return frame;
+    }
+
+    // blocks of different subtrees don't overlap, so the subtrees at the task depth and the leaves above it are
+    // drawn in any order
+    int depth = SubtreeTasks::depthFor(*pool);
+    std::vector<std::pair<size_t, size_t>> subtrees;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i].depth < depth && !(nodes[i].flags & (QuadNode::Leaf | QuadNode::Reused))) continue;
+        subtrees.push_back(std::make_pair(i, nodes[i].end));
+        i = nodes[i].end - 1;
+    }
+    if (!subtrees.empty()) {
+        pool->parallelize_loop((size_t)0, subtrees.size() - 1, [&](size_t k) { draw(subtrees[k].first, subtrees[k].second, nullptr); }, subtrees.size());
+    }
+    return frame;
+}
+
+// the sizes reachable from the whole frame through the split geometry of subdivideBW / subdivideRGB (all four
+// children of a w x h block are w/2 x h/2) that the limits allow to stay a leaf
+std::vector<std::pair<int, int>> Image::blockSizes(int w, int h, SplitLimits limits) {
+    std::vector<std::pair<int, int>> sizes;
+    std::vector<std::pair<int, int>> blocks = { std::make_pair(w, h) };
+    while (!blocks.empty()) {
+        auto [bw, bh] = blocks.back();
+        blocks.pop_back();
+        if (bw <= 0 || bh <= 0 || std::find(sizes.begin(), sizes.end(), std::make_pair(bw, bh)) != sizes.end()) continue;
+        bool alwaysSplit = limits.maxLeaf > 0 && bw > limits.maxLeaf && bh > limits.maxLeaf;
+        if (!alwaysSplit) sizes.push_back(std::make_pair(bw, bh));
+        if (bw > limits.minSplit && bh > limits.minSplit) blocks.push_back(std::make_pair(bw / 2, bh / 2));
+    }
+    std::sort(sizes.begin(), sizes.end());
+    return sizes;
+}
+
+// Quadtree::scaled rounds block edges down, so a block of width bw is floor(bw * targetW / w) or one more pixel
+// wide once scaled, same for the height
+std::vector<std::pair<int, int>> Image::scaledSizes(const std::vector<std::pair<int, int>>& sizes, int w, int h, int targetW, int targetH) {
+    if (w == targetW && h == targetH) return sizes;
+    std::vector<std::pair<int, int>> scaled;
+    for (const auto& [bw, bh] : sizes) {
+        for (int extraW = 0; extraW < 2; extraW++) {
+            for (int extraH = 0; extraH < 2; extraH++) {
+                int rw = (int64_t)bw * targetW / w + extraW;
+                int rh = (int64_t)bh * targetH / h + extraH;
+                if (rw > 0 && rh > 0) scaled.push_back(std::make_pair(rw, rh));
+            }
+        }
+    }
+    std::sort(scaled.begin(), scaled.end());
+    scaled.erase(std::unique(scaled.begin(), scaled.end()), scaled.end());
+    return scaled;
 }
@@ -1,6 +1,5 @@
 #ifndef IMAGE_H
 #define IMAGE_H
-#endif
 
 #include <stdint.h>
 #include <iostream>
@@ -9,9 +8,81 @@
 #include <math.h>
 #include <vector>
 #include <map>
+#include <list>
+#include <tuple>
+#include <algorithm>
+#include <memory>
+
+struct Sprite;
+struct SpriteAtlas;
+struct SummedAreaTable;
+struct BlockPyramid;
+struct TintCache;
+struct FrameDelta;
+struct Quadtree;
+struct SubtreeTasks;
+class thread_pool;
+class work_stealing_pool;
+
+// how quadify gathers block statistics: top-down from a summed-area table or bottom-up from a pyramid
+enum class Analysis { Integral, Pyramid };
+
+// how sprites are resized to block sizes: nearest neighbour from the full sprite, or a box filter from the nearest
+// bigger level of a mip chain, smoother and more stable from one size to the next
+enum class SpriteFilter { Nearest, Area };
+
+// murmur3 style 64 bit hash, seed it with whatever else the bytes should be told apart by
+uint64_t hashBytes(const uint8_t* bytes, size_t length, uint64_t seed);
+
+// blocks only split while both sides are above minSplit, and blocks with both sides above maxLeaf always split
+// (0 for never), which bounds the sizes a leaf, and so a sprite, can have
+struct SplitLimits {
+    uint16_t minSplit;
+    uint16_t maxLeaf;
+};
+
+const SplitLimits splitLimitsBW = {16, 0};
+const SplitLimits splitLimitsRGB = {8, 32};
+const SplitLimits splitLimitsAny = {1, 0}; // for trees from either mode
+
+// the bytes of an Image, used like a std::vector (zeroed when made or grown), except that it can also take over a
+// buffer someone else allocated along with the function that frees it, which lets a decoded frame stay where the
+// decoder put it instead of being copied into place
+class PixelBuffer {
+public:
+    typedef void (*Release)(void*);
+
+    PixelBuffer() = default;
+    explicit PixelBuffer(size_t size);
+    PixelBuffer(uint8_t* pixels, size_t size, Release release); // owns pixels from now on
+    PixelBuffer(const PixelBuffer& other);
+    PixelBuffer(PixelBuffer&& other) noexcept;
+    PixelBuffer& operator=(PixelBuffer other) noexcept;
+    ~PixelBuffer();
+
+    uint8_t* data() { return pixels; }
+    const uint8_t* data() const { return pixels; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    uint8_t* begin() { return pixels; }
+    uint8_t* end() { return pixels + count; }
+    const uint8_t* begin() const { return pixels; }
+    const uint8_t* end() const { return pixels + count; }
+    uint8_t& operator[](size_t i) { return pixels[i]; }
+    const uint8_t& operator[](size_t i) const { return pixels[i]; }
+    uint8_t& at(size_t i);
+    const uint8_t& at(size_t i) const;
+
+    void resize(size_t size); // keeps what fits, the new bytes are 0
+
+private:
+    uint8_t* pixels = nullptr;
+    size_t count = 0;
+    Release release = nullptr;
+};
 
 struct Image {
-    std::vector<uint8_t> data;
+    PixelBuffer data;
     size_t size = 0;
     int w;
     int h;
@@ -21,15 +92,31 @@ struct Image {
     Image(const char* filename);
     Image(int w, int h, int channels);
     Image(const Image& img);
+    Image(Image&& img) noexcept;
+    Image& operator=(const Image& img) = default;
+    Image& operator=(Image&& img) = default;
 
     bool read(const char* filename);
     bool write(const char* filename) const;
+    bool encode(std::vector<uint8_t>& png) const;
+    uint64_t hash() const; // of the pixels and the frame layout, for spotting repeated frames
+
+    // PNG settings for write() / encode(), global to the process so set them before any thread encodes
+    // level 0 stores the pixels uncompressed, 1-9 is stb's deflate (which never goes below 5),
+    // filter -1 picks the best filter per row, 0-4 forces none / sub / up / average / paeth
+    static void setPngCompression(int level, int filter);
 
     Image& colorMask(float r, float g, float b);
-    Image colorMaskNew(float r, float g, float b);
-    Image& overlay(const Image& source, int x, int y);
+    Image colorMaskNew(float r, float g, float b) const;
+    Image& overlay(const Sprite& source, int x, int y);
+    Image& overlay(const Sprite& source, int x, int y, float r, float g, float b); // tints source on the fly
+    Image& overlayRows(const Sprite& source, int x, int y, uint8_t r, uint8_t g, uint8_t b); // RGBA source only
     Image& resizeFast(uint16_t rw, uint16_t rh); // nearest neighbor
-    Image resizeFastNew(uint16_t rw, uint16_t rh);
+    Image resizeFastNew(uint16_t rw, uint16_t rh) const;
+    void resizeInto(uint8_t* out, uint16_t rw, uint16_t rh) const;
+    Image resizeAreaNew(uint16_t rw, uint16_t rh) const; // box filter
+    void resizeAreaInto(uint8_t* out, uint16_t rw, uint16_t rh) const;
+    std::vector<Image> mipChain() const;
     Image cropNew(uint16_t cx, uint16_t cy, uint16_t cw, uint16_t ch);
 
     Image& rect(uint16_t cx, uint16_t cy, uint16_t cw, uint16_t ch, uint8_t r, uint8_t b, uint8_t g);
@@ -38,14 +125,250 @@ struct Image {
     Image& rect(uint8_t r, uint8_t b, uint8_t g);
     Image& rectOutline(uint8_t r, uint8_t b, uint8_t g);
 
-    Image quadifyFrameBW(std::map<std::pair<int, int>, Image>& resizedAmogi);
-    void subdivideBW(uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh, Image& frame, std::map<std::pair<int, int>, Image>& resizedAmogi);
+    // quadify = analyze into a Quadtree + render it, with a delta the blocks whose pixels are the same as in the
+    // reference frame keep the reference's subtree and are copied from its output
+    // with a pool the statistics, the subtrees below the top levels and the drawing are spread over it, the tree and
+    // the pixels come out the same as without
+    Image quadifyFrameBW(const SpriteAtlas& sprites, int frame, Analysis analysis = Analysis::Integral, TintCache* tintCache = nullptr, FrameDelta* delta = nullptr, work_stealing_pool* pool = nullptr);
+    Quadtree analyzeBW(Analysis analysis = Analysis::Integral, FrameDelta* delta = nullptr, work_stealing_pool* pool = nullptr);
+    void subdivideBW(uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh, int depth, int previous, const SummedAreaTable& table, Quadtree& tree, FrameDelta* delta, SubtreeTasks* tasks = nullptr);
+    void subdivideBW(const BlockPyramid& pyramid, int level, int ix, int iy, int previous, Quadtree& tree, FrameDelta* delta, SubtreeTasks* tasks = nullptr);
     int subdivideCheckBW(uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh);
+    int subdivideCheckBW(const SummedAreaTable& table, uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh) const;
 
-    Image quadifyFrameRGB(std::map<std::pair<int, int>, Image>& resizedAmogi);
-    void subdivideRGB(uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh, Image& frameRGB, std::map<std::pair<int, int>, Image>& resizedAmogi);
+    Image quadifyFrameRGB(const SpriteAtlas& sprites, int frame, Analysis analysis = Analysis::Integral, FrameDelta* delta = nullptr, work_stealing_pool* pool = nullptr);
+    Quadtree analyzeRGB(Analysis analysis = Analysis::Integral, FrameDelta* delta = nullptr, work_stealing_pool* pool = nullptr);
+    void subdivideRGB(uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh, int depth, int previous, const SummedAreaTable& table, Quadtree& tree, FrameDelta* delta, SubtreeTasks* tasks = nullptr);
+    void subdivideRGB(const BlockPyramid& pyramid, int level, int ix, int iy, int previous, Quadtree& tree, FrameDelta* delta, SubtreeTasks* tasks = nullptr);
     std::tuple<bool, int, int, int> subdivideCheckRGB(uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh);
+    std::tuple<bool, int, int, int> subdivideCheckRGB(const SummedAreaTable& table, uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh) const;
+
+    // every size a leaf of a w x h frame can have, and what those sizes become in Quadtree::scaled
+    static std::vector<std::pair<int, int>> blockSizes(int w, int h, SplitLimits limits);
+    static std::vector<std::pair<int, int>> scaledSizes(const std::vector<std::pair<int, int>>& sizes, int w, int h, int targetW, int targetH);
+};
+
+// read-only view of the pixels of an Image or of one sprite in a SpriteAtlas
+struct Sprite {
+    const uint8_t* data = nullptr;
+    int w = 0;
+    int h = 0;
+    int channels = 0;
+
+    Sprite() = default;
+    Sprite(const uint8_t* data, int w, int h, int channels) : data(data), w(w), h(h), channels(channels) {}
+    Sprite(const Image& img) : data(img.data.data()), w(img.w), h(img.h), channels(img.channels) {}
+};
+
+// all resized copies of all sprite frames packed into one buffer, every copy starting on its own cache line
+// built once before drawing starts, with every size blockSizes() finds, and never changed after, so any number of
+// threads can draw from it
+// widths and heights map to the columns / rows of a per-frame grid, so finding a sprite is a few array lookups
+// a size that wasn't built gives an empty sprite, which draws nothing
+struct SpriteAtlas {
+    struct Entry {
+        size_t offset;
+        uint16_t w;
+        uint16_t h;
+        uint8_t channels;
+        uint8_t pad[3]; // zeroed, save() writes entries as they are and the compiler's padding would be uninitialized
+    };
+
+    int frameCount = 0;
+    std::shared_ptr<const uint8_t> storage; // owns the copies: a buffer of its own, or the mapped cache file
+    const uint8_t* pixels = nullptr;         // the first copy, on a cache line
+    size_t pixelBytes = 0;
+    std::vector<Entry> entries;
+    std::vector<int32_t> columns; // per width, its column in the grid or -1
+    std::vector<int32_t> rows;    // per height, its row in the grid or -1
+    size_t columnCount = 0;
+    size_t rowCount = 0;
+    std::vector<int32_t> grid;    // frame x row x column, the entry or -1
+
+    SpriteAtlas() = default;
+    SpriteAtlas(const std::vector<Image>& frames, const std::vector<std::pair<int, int>>& sizes, thread_pool& pool, SpriteFilter filter = SpriteFilter::Nearest); // resized on the pool
+
+    int frames() const { return frameCount; }
+    Sprite sprite(int frame, int w, int h) const;
+
+    // the cache file: a versioned header, the layout, and the copies page aligned so load() can map them in as they are
+    bool save(const std::string& path) const;
+    bool load(const std::string& path); // false if it's missing, from another version or not an atlas, this one is left unusable then
+};
+
+// integral image over the first `channels` channels of an Image (gray input is spread to all of them)
+// every entry holds the sum of all pixels above and left of it, so any block sum is 4 lookups
+// sumSq holds the squares summed across channels, only built when needed for the uniformity check
+// the tiled variant integrates per-tile sums instead and adds the pixels of tiles a block only partly covers,
+// so building it reads every pixel once and the tiles a FrameDelta found unchanged aren't read at all
+struct SummedAreaTable {
+    std::vector<uint64_t> sum;
+    std::vector<uint64_t> sumSq;
+    int w;
+    int h;
+    int channels;
+
+    int tile = 1;
+    int cols;
+    int rows;
+    const Image* img = nullptr;
+    std::vector<uint64_t> tiles; // per tile the channel sums, then the square sum
+
+    // with a pool rows (tiles) are summed in parallel and then accumulated down in column strips
+    SummedAreaTable(const Image& img, int channels, bool squares, work_stealing_pool* pool = nullptr);
+    SummedAreaTable(const Image& img, int channels, bool squares, const FrameDelta& delta, work_stealing_pool* pool = nullptr);
+
+    uint64_t blockSum(int channel, uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh) const;
+    uint64_t blockSumSq(uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh) const;
+    void blockSums(uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh, uint64_t* sums, uint64_t* squares) const;
+
+private:
+    void addPixels(int x0, int y0, int x1, int y1, uint64_t* sums, uint64_t* squares) const;
+};
 
-    std::map<std::pair<int, int>, Image> preloadResized(int sw, int sh);
-    void subdivideValues(int sx, int sy, int sw, int sh, std::map<std::pair<int, int>, Image>& image_map);
-};
\ No newline at end of file
+struct BlockStats {
+    uint64_t sum[3] = {0, 0, 0};
+    uint64_t sumSq[3] = {0, 0, 0};
+    uint8_t min[3] = {255, 255, 255};
+    uint8_t max[3] = {0, 0, 0};
+
+    void add(const BlockStats& other);
+};
+
+// mip-style pyramid of block statistics that follows the split geometry of subdivideBW / subdivideRGB
+// level k is a 2^k x 2^k grid of equally sized blocks, down to the first level with a side <= minSize
+// every pixel is accumulated once into the deepest block containing it, then levels are merged bottom-up
+// (odd sizes leave a gap row/column between children, those pixels only count towards the parent)
+struct BlockPyramid {
+    std::vector<std::vector<BlockStats>> levels;
+    std::vector<std::vector<uint16_t>> xs; // block x per level and column
+    std::vector<std::vector<uint16_t>> ys; // block y per level and row
+    std::vector<uint16_t> ws;              // block width per level
+    std::vector<uint16_t> hs;              // block height per level
+    int channels;
+
+    BlockPyramid(const Image& img, int channels, uint16_t minSize, work_stealing_pool* pool = nullptr);
+
+    int depth() const { return (int)levels.size() - 1; }
+    const BlockStats& at(int level, int ix, int iy) const { return levels[level][((size_t)iy << level) + ix]; }
+    uint64_t pixels(int level) const { return (uint64_t)ws[level] * hs[level]; }
+
+    int mean(int level, int ix, int iy, int channel) const;
+    double variance(int level, int ix, int iy, int channel) const;
+    bool uniform(int level, int ix, int iy) const;
+};
+
+// LRU cache of tinted sprite copies keyed by the sprite's pixels and its tint, pays off in BW where only 256 tints exist
+// not synchronized, every worker thread keeps its own
+struct TintCache {
+    typedef std::tuple<const uint8_t*, uint8_t, uint8_t, uint8_t> Key;
+
+    size_t capacity;
+    std::list<std::pair<Key, Image>> entries; // most recently used first
+    std::map<Key, std::list<std::pair<Key, Image>>::iterator> index;
+
+    TintCache(size_t capacity);
+
+    const Image& get(const Sprite& sprite, uint8_t r, uint8_t g, uint8_t b);
+};
+
+// one block of a quadtree, 16 bytes with no pointers: nodes are stored in preorder, so the children of a
+// node follow it directly and `end` (one past its last descendant) jumps over its whole subtree
+struct QuadNode {
+    enum Flags : uint8_t {
+        Leaf = 1,   // not split
+        Drawn = 2,  // leaf that gets a sprite (BW leaves that are too dark don't)
+        Reused = 4, // subtree taken over from a FrameDelta's reference, rendered by copying its pixels
+    };
+
+    uint16_t x;
+    uint16_t y;
+    uint16_t w;
+    uint16_t h;
+    uint8_t r; // block mean, the sprite's tint
+    uint8_t g;
+    uint8_t b;
+    uint8_t depth;
+    uint8_t flags;
+    uint32_t end;
+};
+
+// a quadified frame as one flat array of nodes, produced by analyzeBW / analyzeRGB and drawn by render()
+struct Quadtree {
+    int w;
+    int h;
+    std::vector<QuadNode> nodes;
+
+    Quadtree(int w = 0, int h = 0);
+
+    size_t add(uint16_t x, uint16_t y, uint16_t w, uint16_t h, int depth, uint8_t r, uint8_t g, uint8_t b); // flags and end are up to the caller
+    void reuse(const Quadtree& other, int node); // appends a copy of other's subtree at node
+    static int child(const Quadtree* tree, int node, int k); // k-th child (tl, tr, bl, br) or -1
+    size_t leaves() const;
+    int maxDepth() const; // of the deepest node, 0 for just the root
+    Quadtree scaled(int targetW, int targetH) const; // block edges mapped onto a targetW x targetH frame
+
+    // reused subtrees are copied from reference when it's given and the same size, and drawn like the rest otherwise
+    // leaves are drawn with the atlas' copies of sprite frame `frame`
+    // with a pool the subtrees at SubtreeTasks::depthFor(pool) are drawn on it, without the tint cache (it's one thread's)
+    Image render(const SpriteAtlas& sprites, int frame, TintCache* tintCache = nullptr, const Image* reference = nullptr, work_stealing_pool* pool = nullptr) const;
+};
+
+// the blocks at one depth that analyzeBW / analyzeRGB leave as placeholders while building the top of the tree
+// their subtrees only depend on the pixels inside them, so they're built on a pool, each into a tree of its own, and
+// spliced into the placeholders afterwards, which gives the same nodes in the same order as one recursion
+// the frame's own thread helps with them and then sleeps in parallelize_loop until the last one is done, so quadify
+// threads calling in from outside the pool don't spin while its workers finish
+struct SubtreeTasks {
+    struct Task {
+        uint16_t sx;
+        uint16_t sy;
+        uint16_t sw;
+        uint16_t sh;
+        int depth; // the pyramid level
+        int ix;    // the pyramid block
+        int iy;
+        int previous;
+        size_t node; // the placeholder
+    };
+
+    int depth;
+    std::vector<Task> tasks;
+
+    SubtreeTasks(int depth) : depth(depth) {}
+
+    static int depthFor(const work_stealing_pool& pool); // deep enough for a few subtrees per thread
+    void defer(Quadtree& tree, uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh, int depth, int ix, int iy, int previous);
+};
+
+// what temporal reuse keeps of a quadified frame: its pixels, its output (empty when only the tree is written out),
+// its tree and its tile sums when they came from a tiled SummedAreaTable
+struct QuadifiedFrame {
+    Image input;
+    Image output;
+    Quadtree tree;
+    std::vector<uint64_t> tiles;
+};
+
+// which parts of a frame changed since a reference frame that was quadified with the same sprites
+// a block's split decisions and drawn pixels only depend on the pixels inside it, so a block that is unchanged
+// and also a node of the reference's tree (not drawn over by a bigger leaf) keeps its subtree and its pixels
+// changes are tracked per tile (any differing pixel dirties the whole tile) with an integral over the tile grid
+// the tree and tile sums of the frame being quadified are collected for the delta of the next frame
+struct FrameDelta {
+    const QuadifiedFrame* previous;
+    int w;
+    int tile;
+    int cols;
+    int rows;
+    std::vector<uint32_t> dirty; // (cols + 1) x (rows + 1) integral of dirty tiles
+    Quadtree tree;
+    std::vector<uint64_t> tiles;
+
+    FrameDelta(const Image& current, const QuadifiedFrame* previous, int tile = 8); // previous may be null
+
+    bool changed(int tx0, int ty0, int tx1, int ty1) const; // any dirty tile in [tx0, tx1) x [ty0, ty1)
+    bool unchanged(uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh) const; // no tile under the block is dirty
+};
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// blocking queue with a fixed capacity, producers wait while it is full so memory stays bounded
+// close() wakes everyone up, pop() keeps draining what's left and returns false once it's empty
+template <typename T>
+class BoundedQueue {
+public:
+    BoundedQueue(size_t capacity) : capacity(capacity ? capacity : 1) {}
+
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+        if (closed) return false;
+        items.push(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+        if (items.empty()) return false;
+        item = std::move(items.front());
+        items.pop();
+        notFull.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::scoped_lock lock(mutex);
+        closed = true;
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+    std::queue<T> items;
+    size_t capacity;
+    bool closed = false;
+};
+
+// keeps frame numbers admitted into the pipeline within `size` of the next one to be written, so the
+// reorder buffer in front of an in-order writer can't grow without bound when a single frame lags behind
+class ReorderWindow {
+public:
+    ReorderWindow(int first, size_t size) : next(first), size(size ? size : 1) {}
+
+    void admit(int i) {
+        std::unique_lock<std::mutex> lock(mutex);
+        moved.wait(lock, [&] { return i < next + (int)size; });
+    }
+
+    void advance() {
+        std::scoped_lock lock(mutex);
+        next++;
+        moved.notify_all();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable moved;
+    int next;
+    size_t size;
+};
+
+// a group of threads all running the same stage body
+class Stage {
+public:
+    Stage(unsigned threadCount, const std::function<void()>& body) {
+        for (unsigned i = 0; i < (threadCount ? threadCount : 1); i++) {
+            threads.emplace_back(body);
+        }
+    }
+
+    void join() {
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        threads.clear();
+    }
+
+    ~Stage() {
+        join();
+    }
+
+private:
+    std::vector<std::thread> threads;
+};
+
+#endif
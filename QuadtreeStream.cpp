@@ -0,0 +1,244 @@
+#include "QuadtreeStream.h"
+#include "VideoStream.h"
+
+#include <climits>
+#include <iostream>
+
+#include "lib/stb_image.h"
+
+// stb_image_write's deflate, compiled along with the rest of it in Image.cpp
+extern "C" unsigned char* stbi_zlib_compress(unsigned char* data, int data_len, int* out_len, int quality);
+
+enum Token : uint8_t {
+    Split = 0,
+    DrawnLeaf = 1,
+    HiddenLeaf = 2,
+    Same = 3,
+    Gray = 4, // with DrawnLeaf: one tint byte follows instead of three
+};
+
+static void pushLittleEndian(std::vector<uint8_t>& out, uint32_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        out.push_back(value >> (8 * i));
+    }
+}
+
+static uint32_t readLittleEndian(const uint8_t* in, int bytes) {
+    uint32_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= (uint32_t)in[i] << (8 * i);
+    }
+    return value;
+}
+
+// both subtrees draw the same: same splits, same drawn leaves with the same tints (hidden leaves' tints don't matter)
+// they cover the same block, so the geometry is the same too
+static bool sameSubtree(const Quadtree& tree, int node, const Quadtree& other, int otherNode) {
+    uint32_t count = tree.nodes[node].end - node;
+    if (other.nodes[otherNode].end - otherNode != count) return false;
+    for (uint32_t k = 0; k < count; k++) {
+        const QuadNode& a = tree.nodes[node + k];
+        const QuadNode& b = other.nodes[otherNode + k];
+        uint8_t kind = QuadNode::Leaf | QuadNode::Drawn;
+        if ((a.flags & kind) != (b.flags & kind)) return false;
+        if ((a.flags & QuadNode::Drawn) && (a.r != b.r || a.g != b.g || a.b != b.b)) return false;
+    }
+    return true;
+}
+
+// reference: the node for the same block in the previous frame's tree, -1 if that tree didn't reach it
+static void encodeNode(const Quadtree& tree, int node, const Quadtree& previous, int reference, std::vector<uint8_t>& tokens) {
+    if (reference >= 0 && sameSubtree(tree, node, previous, reference)) {
+        tokens.push_back(Same);
+        return;
+    }
+
+    const QuadNode& block = tree.nodes[node];
+    if (!(block.flags & QuadNode::Leaf)) {
+        tokens.push_back(Split);
+        for (int k = 0; k < 4; k++) {
+            encodeNode(tree, Quadtree::child(&tree, node, k), previous, Quadtree::child(&previous, reference, k), tokens);
+        }
+    } else if (!(block.flags & QuadNode::Drawn)) {
+        tokens.push_back(HiddenLeaf);
+    } else if (block.r == block.g && block.g == block.b) {
+        tokens.push_back(DrawnLeaf | Gray);
+        tokens.push_back(block.r);
+    } else {
+        tokens.push_back(DrawnLeaf);
+        tokens.push_back(block.r);
+        tokens.push_back(block.g);
+        tokens.push_back(block.b);
+    }
+}
+
+// false if the tokens run out or don't fit the tree
+static bool decodeNode(const uint8_t*& pos, const uint8_t* end, uint16_t sx, uint16_t sy, uint16_t sw, uint16_t sh, int depth,
+                       const Quadtree& previous, int reference, Quadtree& tree) {
+    if (pos == end) return false;
+    uint8_t token = *pos++;
+    if ((token & 3) == Same) {
+        if (reference < 0) return false;
+        size_t root = tree.nodes.size();
+        tree.reuse(previous, reference);
+        tree.nodes[root].flags &= ~QuadNode::Reused;
+        return true;
+    }
+
+    size_t node = tree.add(sx, sy, sw, sh, depth, 0, 0, 0);
+    if ((token & 3) == Split) {
+        if (sw < 2 || sh < 2) return false;
+        uint16_t sw_r = sw - sw/2;
+        uint16_t sh_b = sh - sh/2;
+        if (!decodeNode(pos, end, sx, sy, sw/2, sh/2, depth + 1, previous, Quadtree::child(&previous, reference, 0), tree)
+            || !decodeNode(pos, end, sx + sw_r, sy, sw/2, sh/2, depth + 1, previous, Quadtree::child(&previous, reference, 1), tree)
+            || !decodeNode(pos, end, sx, sy + sh_b, sw/2, sh/2, depth + 1, previous, Quadtree::child(&previous, reference, 2), tree)
+            || !decodeNode(pos, end, sx + sw_r, sy + sh_b, sw/2, sh/2, depth + 1, previous, Quadtree::child(&previous, reference, 3), tree)) {
+            return false;
+        }
+    } else if ((token & 3) == HiddenLeaf) {
+        tree.nodes[node].flags = QuadNode::Leaf;
+    } else {
+        int tint = token & Gray ? 1 : 3;
+        if (end - pos < tint) return false;
+        QuadNode& block = tree.nodes[node];
+        block.flags = QuadNode::Leaf | QuadNode::Drawn;
+        block.r = pos[0];
+        block.g = pos[tint == 1 ? 0 : 1];
+        block.b = pos[tint == 1 ? 0 : 2];
+        pos += tint;
+    }
+    tree.nodes[node].end = tree.nodes.size();
+    return true;
+}
+
+QuadtreeWriter::QuadtreeWriter(const std::string& path, int w, int h, int sprites) : w(w), h(h) {
+    file = openStream(path, "wb", ownsFile);
+    if (file == nullptr) {
+        std::cerr<<"Failed to open "<<path<<std::endl;
+        return;
+    }
+    std::vector<uint8_t> header = { 'Q', 'T', 'S', '1' };
+    pushLittleEndian(header, w, 2);
+    pushLittleEndian(header, h, 2);
+    pushLittleEndian(header, sprites, 1);
+    fwrite(header.data(), 1, header.size(), file);
+}
+
+QuadtreeWriter::~QuadtreeWriter() {
+    close();
+}
+
+bool QuadtreeWriter::close() {
+    if (file == nullptr) return true;
+    bool closed = ownsFile ? fclose(file) == 0 : fflush(file) == 0;
+    file = nullptr;
+    return closed;
+}
+
+bool QuadtreeWriter::write(int i, int index, const Quadtree& tree) {
+    if (tree.w != w || tree.h != h || tree.nodes.empty()) {
+        std::cerr<<"Frame "<<i<<" doesn't match the size of the quadtree stream"<<std::endl;
+        return false;
+    }
+
+    tokens.clear();
+    encodeNode(tree, 0, previous, previous.nodes.empty() ? -1 : 0, tokens);
+    previous = tree;
+
+    int length = 0;
+    unsigned char* deflated = stbi_zlib_compress(tokens.data(), tokens.size(), &length, 8);
+    if (deflated == nullptr) return false;
+    std::vector<uint8_t> header;
+    pushLittleEndian(header, i, 4);
+    pushLittleEndian(header, index, 1);
+    pushLittleEndian(header, tokens.size(), 4);
+    pushLittleEndian(header, length, 4);
+    bool written = fwrite(header.data(), 1, header.size(), file) == header.size()
+        && fwrite(deflated, 1, length, file) == (size_t)length;
+    free(deflated);
+    if (written) bytesWritten += header.size() + length;
+    return written;
+}
+
+QuadtreeReader::QuadtreeReader(const std::string& path) {
+    file = openStream(path, "rb", ownsFile);
+    if (file == nullptr) {
+        std::cerr<<"Failed to open "<<path<<std::endl;
+        return;
+    }
+    uint8_t header[9];
+    if (fread(header, 1, 9, file) != 9 || std::string((const char*)header, 4) != "QTS1") {
+        std::cerr<<"Not a quadtree stream: "<<path<<std::endl;
+        return;
+    }
+    w = readLittleEndian(header + 4, 2);
+    h = readLittleEndian(header + 6, 2);
+    sprites = header[8];
+
+    if (ownsFile && fseek(file, 0, SEEK_END) == 0) {
+        long end = ftell(file);
+        if (end >= 9 && fseek(file, 9, SEEK_SET) == 0) fileSize = end;
+    }
+}
+
+QuadtreeReader::~QuadtreeReader() {
+    if (file != nullptr && ownsFile) fclose(file);
+}
+
+bool QuadtreeReader::read(int& i, int& index, Quadtree& tree) {
+    if (!ok()) return false;
+    uint8_t header[13];
+    size_t got = fread(header, 1, 13, file);
+    if (got != 13) {
+        if (got != 0) {
+            std::cerr<<"Truncated quadtree stream after "<<bytesRead<<" bytes of frames"<<std::endl;
+            corrupt = true;
+        }
+        return false;
+    }
+    i = (int32_t)readLittleEndian(header, 4);
+    index = header[4];
+    uint32_t size = readLittleEndian(header + 5, 4);
+    uint32_t packedSize = readLittleEndian(header + 9, 4);
+
+    // at most a node per pixel plus the splits above them, each a token and up to 3 tint bytes
+    uint64_t maxTokens = ((uint64_t)w * h * 4 / 3 + 1) * 4;
+    int64_t left = fileSize - 9 - (int64_t)bytesRead - 13;
+    if (size == 0 || size > maxTokens || size > INT_MAX || packedSize > INT_MAX || (fileSize >= 0 && packedSize > left)) {
+        std::cerr<<"Corrupt quadtree stream at frame "<<i<<": "<<size<<" token bytes deflated into "<<packedSize<<std::endl;
+        corrupt = true;
+        return false;
+    }
+    // the buffer only grows as far as the bytes actually arrive
+    packed.clear();
+    while (packed.size() < packedSize) {
+        size_t have = packed.size();
+        packed.resize(std::min<size_t>(packedSize, have + ((size_t)1 << 20)));
+        if (fread(packed.data() + have, 1, packed.size() - have, file) != packed.size() - have) {
+            std::cerr<<"Truncated quadtree stream at frame "<<i<<std::endl;
+            corrupt = true;
+            return false;
+        }
+    }
+    bytesRead += 13 + packed.size();
+
+    // a fixed buffer, deflated data that would decode to more than the header says fails instead of growing it
+    tokens.resize(size);
+    int length = stbi_zlib_decode_buffer((char*)tokens.data(), size, (const char*)packed.data(), packed.size());
+    if (length != (int)size) {
+        std::cerr<<"Corrupt quadtree stream at frame "<<i<<std::endl;
+        corrupt = true;
+        return false;
+    }
+    const uint8_t* pos = tokens.data();
+    tree = Quadtree(w, h);
+    bool decoded = decodeNode(pos, pos + length, 0, 0, w, h, 0, previous, previous.nodes.empty() ? -1 : 0, tree);
+    if (!decoded) {
+        std::cerr<<"Corrupt quadtree stream at frame "<<i<<std::endl;
+        corrupt = true;
+        return false;
+    }
+    previous = tree;
+    return true;
+}
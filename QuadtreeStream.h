@@ -0,0 +1,65 @@
+#ifndef QUADTREE_STREAM_H
+#define QUADTREE_STREAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "Image.h"
+
+// .qts: quadified frames stored as their trees instead of their pixels, so they can be drawn again at any size
+// and with any sprites, "-" is stdin / stdout
+// header: "QTS1", u16 width, u16 height, u8 sprite frames
+// frame:  i32 frame number, u8 sprite frame, u32 token bytes, u32 deflated bytes, deflated tokens (all little endian)
+// tokens walk the tree in preorder with one byte per node: split, drawn leaf, hidden leaf, or the same subtree as
+// the block had in the previous frame of the file, which covers the whole frame for a still shot
+// a drawn leaf is followed by its tint, 1 byte when it's gray and 3 otherwise
+// block geometry isn't stored, it follows from the frame size and the split geometry of subdivideBW / subdivideRGB
+class QuadtreeWriter {
+public:
+    QuadtreeWriter(const std::string& path, int w, int h, int sprites);
+    ~QuadtreeWriter();
+
+    bool ok() const { return file != nullptr; }
+    bool write(int i, int index, const Quadtree& tree); // in frame order from one thread, false on a short write
+    bool close(); // false if anything didn't make it into the file, the destructor closes too but can't tell
+
+    uint64_t bytesWritten = 0; // frames so far
+
+private:
+    FILE* file = nullptr;
+    bool ownsFile = false;
+    int w;
+    int h;
+    Quadtree previous;
+    std::vector<uint8_t> tokens;
+};
+
+// reads the frames of a .qts file back in order, trees come out without Reused flags
+// lengths from the file are checked before anything is allocated for them: the deflated bytes against what's left
+// of the file (a pipe is read in chunks instead), the tokens against what a tree of the frame size can need
+class QuadtreeReader {
+public:
+    QuadtreeReader(const std::string& path);
+    ~QuadtreeReader();
+
+    bool ok() const { return file != nullptr && w > 0 && h > 0; }
+    bool read(int& i, int& index, Quadtree& tree); // false at the end of the file or on a corrupt frame
+
+    int w = 0;
+    int h = 0;
+    int sprites = 0;
+    uint64_t bytesRead = 0; // frames so far
+    bool corrupt = false; // read() stopped before the end of the file
+
+private:
+    FILE* file = nullptr;
+    bool ownsFile = false;
+    int64_t fileSize = -1; // unknown for a pipe
+    Quadtree previous;
+    std::vector<uint8_t> packed;
+    std::vector<uint8_t> tokens;
+};
+
+#endif
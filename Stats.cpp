@@ -0,0 +1,164 @@
+#include "Stats.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+
+static const char* statNames[] = { "decode", "analyze", "render", "encode", "write", "leaves", "depth", "bytes_read", "bytes_written" };
+
+static bool isTime(int stat) {
+    return stat <= (int)Stat::Write;
+}
+
+// the JSON to path, "-" is stderr
+static bool writeText(const std::string& path, const std::string& text) {
+    if (path == "-") {
+        std::cerr<<text;
+        return true;
+    }
+    std::string temporary = path + ".tmp";
+    std::ofstream file(temporary, std::ios::binary);
+    file<<text;
+    file.close();
+    std::error_code error;
+    if (file) std::filesystem::rename(temporary, path, error);
+    if (!file || error) {
+        std::cerr<<"Failed to write "<<path<<std::endl;
+        std::filesystem::remove(temporary, error);
+        return false;
+    }
+    return true;
+}
+
+Stats::Stats(bool tracing) : tracing(tracing) {
+    static std::atomic<uint64_t> ids(0);
+    id = ++ids;
+    started = now();
+}
+
+uint64_t Stats::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Stats::Buffer& Stats::buffer() {
+    thread_local std::pair<uint64_t, Buffer*> current(0, nullptr);
+    if (current.first != id) {
+        std::scoped_lock lock(mutex);
+        buffers.emplace_back(new Buffer);
+        buffers.back()->thread = buffers.size();
+        current = {id, buffers.back().get()};
+    }
+    return *current.second;
+}
+
+void Stats::record(int i, Stat stat, uint64_t value) {
+    buffer().samples.push_back(Sample{i, stat, value});
+}
+
+void Stats::time(int i, Stat stat, uint64_t start) {
+    uint64_t end = now();
+    Buffer& local = buffer();
+    local.samples.push_back(Sample{i, stat, end - start});
+    if (tracing) local.spans.push_back(Span{statNames[(int)stat], i, start, end});
+}
+
+void Stats::span(const char* name, int i, uint64_t start) {
+    if (tracing) buffer().spans.push_back(Span{name, i, start, now()});
+}
+
+void Stats::thread(const char* name) {
+    buffer().name = name;
+}
+
+// times in ms, counters as they are
+static void writeValue(std::ostream& out, int stat, uint64_t value) {
+    if (isTime(stat)) out<<value / 1e6;
+    else out<<value;
+}
+
+bool Stats::write(const std::string& path) const {
+    uint64_t wall = now() - started;
+
+    // a stat recorded twice for a frame adds up, except for depth which keeps the deepest
+    std::map<int, std::array<uint64_t, (size_t)Stat::Count>> frames;
+    std::map<int, std::array<bool, (size_t)Stat::Count>> present;
+    for (const auto& buffer : buffers) {
+        for (const Sample& sample : buffer->samples) {
+            uint64_t& value = frames[sample.i][(size_t)sample.stat];
+            bool& seen = present[sample.i][(size_t)sample.stat];
+            if (!seen) value = sample.value;
+            else if (sample.stat == Stat::Depth) value = std::max(value, sample.value);
+            else value += sample.value;
+            seen = true;
+        }
+    }
+
+    std::ostringstream out;
+    out.setf(std::ios::fixed);
+    out.precision(3);
+    out<<"{\n  \"frames\": "<<frames.size()<<",\n  \"wall_ms\": "<<wall / 1e6<<",\n  \"stats\": {";
+    for (int stat = 0; stat < (int)Stat::Count; stat++) {
+        std::vector<uint64_t> values;
+        uint64_t total = 0;
+        for (const auto& [i, frame] : frames) {
+            if (!present[i][stat]) continue;
+            values.push_back(frame[stat]);
+            total += frame[stat];
+        }
+        std::sort(values.begin(), values.end());
+        // nearest rank
+        auto percentile = [&](int p) { return values.empty() ? 0 : values[(values.size() * p + 99) / 100 - 1]; };
+
+        out<<(stat ? "," : "")<<"\n    \""<<statNames[stat]<<(isTime(stat) ? "_ms" : "")<<"\": { \"count\": "<<values.size();
+        out<<", \"total\": ";
+        writeValue(out, stat, total);
+        out<<", \"p50\": ";
+        writeValue(out, stat, percentile(50));
+        out<<", \"p99\": ";
+        writeValue(out, stat, percentile(99));
+        out<<", \"max\": ";
+        writeValue(out, stat, values.empty() ? 0 : values.back());
+        out<<" }";
+    }
+    out<<"\n  },\n  \"per_frame\": [";
+    bool first = true;
+    for (const auto& [i, frame] : frames) {
+        out<<(first ? "" : ",")<<"\n    { \"frame\": "<<i;
+        first = false;
+        for (int stat = 0; stat < (int)Stat::Count; stat++) {
+            if (!present[i][stat]) continue;
+            out<<", \""<<statNames[stat]<<(isTime(stat) ? "_ms" : "")<<"\": ";
+            writeValue(out, stat, frame[stat]);
+        }
+        out<<" }";
+    }
+    out<<"\n  ]\n}\n";
+    return writeText(path, out.str());
+}
+
+// complete ("X") events in microseconds since the Stats was made, frame numbers in args, and a name per thread
+bool Stats::writeTrace(const std::string& path) const {
+    std::ostringstream out;
+    out.setf(std::ios::fixed);
+    out.precision(3);
+    out<<"{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    bool first = true;
+    for (const auto& buffer : buffers) {
+        out<<(first ? "" : ",")<<"\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "<<buffer->thread;
+        out<<", \"args\": {\"name\": \""<<buffer->name<<" "<<buffer->thread<<"\"}}";
+        first = false;
+        for (const Span& span : buffer->spans) {
+            out<<",\n{\"name\": \""<<span.name<<"\", \"ph\": \"X\", \"pid\": 1, \"tid\": "<<buffer->thread;
+            out<<", \"ts\": "<<(span.start - started) / 1e3<<", \"dur\": "<<(span.end - span.start) / 1e3;
+            out<<", \"args\": {\"frame\": "<<span.i<<"}}";
+        }
+    }
+    out<<"\n]}\n";
+    return writeText(path, out.str());
+}
@@ -0,0 +1,75 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// what a frame spent in each pipeline stage (ns) and the counters that explain it
+enum class Stat : uint8_t {
+    Decode,       // reading and decoding the input (a .qts tree for Render)
+    Analyze,      // building the quadtree
+    Render,       // drawing it with the sprites
+    Encode,       // PNG / stream frame
+    Write,        // to the disk / stream
+    Leaves,
+    Depth,        // deepest node of the tree
+    BytesRead,
+    BytesWritten,
+    Count
+};
+
+// per-frame samples for --stats, cheap enough to leave on: every thread appends to a buffer of its own without
+// locking (only its first sample takes the mutex to register the buffer), nothing is added up until write()
+// with tracing every time() and span() also keeps when it started and ended on which thread, for --trace
+// write() / writeTrace() read every buffer, so they may only run once the threads that recorded into them are done
+class Stats {
+public:
+    Stats(bool tracing = false);
+
+    static uint64_t now(); // steady clock, ns
+
+    void record(int i, Stat stat, uint64_t value);
+    void time(int i, Stat stat, uint64_t start); // from start until now
+    void span(const char* name, int i, uint64_t start); // only traced, name has to outlive this (a literal)
+    void thread(const char* name); // of the calling thread in the trace
+
+    // per-run count / total / p50 / p99 / max of every stat over the frames that have it, then every frame,
+    // as JSON to path ("-" is stderr, a file is written next to it and renamed into place)
+    bool write(const std::string& path) const;
+    // the spans as Chrome trace events (chrome://tracing, ui.perfetto.dev), one track per thread, same paths
+    bool writeTrace(const std::string& path) const;
+
+private:
+    struct Sample {
+        int i;
+        Stat stat;
+        uint64_t value;
+    };
+
+    struct Span {
+        const char* name;
+        int i;
+        uint64_t start;
+        uint64_t end;
+    };
+
+    struct Buffer {
+        int thread;
+        const char* name = "";
+        std::vector<Sample> samples;
+        std::vector<Span> spans;
+    };
+
+    Buffer& buffer();
+
+    bool tracing;
+    uint64_t id; // tells the buffers of this and an earlier Stats apart in a thread that recorded into both
+    uint64_t started;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Buffer>> buffers;
+};
+
+#endif
@@ -0,0 +1,248 @@
+#include "VideoStream.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <iostream>
+#include <sstream>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+bool parseStreamFormat(const std::string& name, StreamFormat& format) {
+    if (name == "y4m") format = StreamFormat::Y4M;
+    else if (name == "rgb24") format = StreamFormat::RGB24;
+    else if (name == "gray8") format = StreamFormat::GRAY8;
+    else return false;
+    return true;
+}
+
+FILE* openStream(const std::string& path, const char* mode, bool& owns) {
+    owns = path != "-";
+    if (owns) return fopen(path.c_str(), mode);
+    FILE* stream = mode[0] == 'r' ? stdin : stdout;
+#ifdef _WIN32
+    _setmode(_fileno(stream), _O_BINARY);
+#endif
+    return stream;
+}
+
+static inline uint8_t clampByte(int value) {
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+// sides fit the uint16 the quadtree and the sprite atlas keep them in, and a frame stays below 16K x 16K pixels
+static bool validFrameSize(int w, int h) {
+    return w > 0 && h > 0 && w <= 65535 && h <= 65535 && (uint64_t)w * h <= (uint64_t)16384 * 16384;
+}
+
+// the decimal number after a header token's tag letter, nothing else may follow it
+static bool parseHeaderNumber(const std::string& token, int& value) {
+    const char* digits = token.c_str() + 1;
+    char* end = nullptr;
+    errno = 0;
+    long number = strtol(digits, &end, 10);
+    if (end == digits || *end != '\0' || errno == ERANGE || number < 0 || number > 65535) return false;
+    value = (int)number;
+    return true;
+}
+
+FrameReader::FrameReader(const std::string& path, StreamFormat format, int w, int h) : w(w), h(h), format(format) {
+    file = openStream(path, "rb", ownsFile);
+    if (file == nullptr) {
+        std::cerr<<"Failed to open "<<path<<std::endl;
+        return;
+    }
+    if (format == StreamFormat::Y4M && !readHeader()) {
+        std::cerr<<"Not a supported YUV4MPEG2 stream: "<<path<<std::endl;
+        this->w = this->h = 0;
+    } else if (!validFrameSize(this->w, this->h)) {
+        std::cerr<<"Frame size "<<this->w<<"x"<<this->h<<" of "<<path<<" isn't supported, sides have to be 1 - 65535 and frames at most 16384x16384 pixels"<<std::endl;
+        this->w = this->h = 0;
+    }
+}
+
+FrameReader::~FrameReader() {
+    if (file != nullptr && ownsFile) fclose(file);
+}
+
+// YUV4MPEG2 W<w> H<h> [F.. I.. A.. C<chroma> X...]\n
+bool FrameReader::readHeader() {
+    std::string line;
+    for (int c = fgetc(file); c != '\n'; c = fgetc(file)) {
+        if (c == EOF) return false;
+        line += (char)c;
+    }
+
+    std::istringstream tokens(line);
+    std::string token;
+    tokens >> token;
+    if (token != "YUV4MPEG2") return false;
+    while (tokens >> token) {
+        switch (token[0]) {
+            case 'W':
+            case 'H':
+                if (!parseHeaderNumber(token, token[0] == 'W' ? w : h)) {
+                    std::cerr<<"Bad frame size "<<token<<" in the header"<<std::endl;
+                    return false;
+                }
+                break;
+            case 'C': chroma = token.substr(1); break;
+            case 'X': if (token == "XCOLORRANGE=FULL") fullRange = true; break;
+        }
+    }
+
+    // only 8 bit, C420p10 and the like have 2 byte samples
+    static const char* supported[] = { "420", "420jpeg", "420paldv", "420mpeg2", "422", "444", "mono" };
+    for (const char* name : supported) {
+        if (chroma == name) return true;
+    }
+    std::cerr<<"Unsupported chroma / bit depth C"<<chroma<<", only 8 bit 420, 422, 444 and mono are read"<<std::endl;
+    return false;
+}
+
+bool FrameReader::read(Image& frame) {
+    if (!ok()) return false;
+    if (format == StreamFormat::Y4M) return readY4MFrame(frame);
+
+    int channels = format == StreamFormat::RGB24 ? 3 : 1;
+    frame.w = w;
+    frame.h = h;
+    frame.channels = channels;
+    frame.size = (size_t)w * h * channels;
+    frame.data.resize(frame.size);
+    if (fread(frame.data.data(), 1, frame.size, file) != frame.size) return false;
+    bytesRead += frame.size;
+    return true;
+}
+
+bool FrameReader::readY4MFrame(Image& frame) {
+    // FRAME[ params]\n
+    char tag[5];
+    if (fread(tag, 1, 5, file) != 5 || std::string(tag, 5) != "FRAME") return false;
+    bytesRead += 6;
+    for (int c = fgetc(file); c != '\n'; c = fgetc(file), bytesRead++) {
+        if (c == EOF) return false;
+    }
+
+    bool mono = chroma == "mono";
+    int cw = chroma == "444" ? w : (w + 1) / 2;
+    int ch = chroma == "422" || chroma == "444" || mono ? h : (h + 1) / 2;
+    size_t lumaSize = (size_t)w * h;
+    size_t chromaSize = mono ? 0 : (size_t)cw * ch;
+    planes.resize(lumaSize + chromaSize * 2);
+    if (fread(planes.data(), 1, planes.size(), file) != planes.size()) return false;
+    bytesRead += planes.size();
+
+    frame.w = w;
+    frame.h = h;
+    frame.channels = mono ? 1 : 3;
+    frame.size = (size_t)w * h * frame.channels;
+    frame.data.resize(frame.size);
+
+    if (mono) {
+        std::copy(planes.begin(), planes.begin() + lumaSize, frame.data.begin());
+        return true;
+    }
+
+    const uint8_t* lumaPlane = planes.data();
+    const uint8_t* uPlane = lumaPlane + lumaSize;
+    const uint8_t* vPlane = uPlane + chromaSize;
+    int xShift = cw == w ? 0 : 1;
+    int yShift = ch == h ? 0 : 1;
+
+    // integer BT.601 with 8 fractional bits, chroma upsampled by nearest neighbour
+    for (int y = 0; y < h; y++) {
+        const uint8_t* luma = lumaPlane + (size_t)y * w;
+        const uint8_t* u = uPlane + (size_t)(y >> yShift) * cw;
+        const uint8_t* v = vPlane + (size_t)(y >> yShift) * cw;
+        uint8_t* rgb = frame.data.data() + (size_t)y * w * 3;
+        for (int x = 0; x < w; x++, rgb += 3) {
+            int d = u[x >> xShift] - 128;
+            int e = v[x >> xShift] - 128;
+            if (fullRange) {
+                int c = luma[x] << 8;
+                rgb[0] = clampByte((c + 359 * e + 128) >> 8);
+                rgb[1] = clampByte((c - 88 * d - 183 * e + 128) >> 8);
+                rgb[2] = clampByte((c + 454 * d + 128) >> 8);
+            } else {
+                int c = 298 * (luma[x] - 16);
+                rgb[0] = clampByte((c + 409 * e + 128) >> 8);
+                rgb[1] = clampByte((c - 100 * d - 208 * e + 128) >> 8);
+                rgb[2] = clampByte((c + 516 * d + 128) >> 8);
+            }
+        }
+    }
+
+    return true;
+}
+
+FrameWriter::FrameWriter(const std::string& path, StreamFormat format, int w, int h, int fps) : w(w), h(h), format(format) {
+    file = openStream(path, "wb", ownsFile);
+    if (file == nullptr) {
+        std::cerr<<"Failed to open "<<path<<std::endl;
+        return;
+    }
+    // flushed so a full disk or a closed pipe fails here rather than with the first frame
+    if (format == StreamFormat::Y4M && (fprintf(file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", w, h, fps) < 0 || fflush(file) != 0)) {
+        std::cerr<<"Failed to write the header of "<<path<<std::endl;
+        close();
+    }
+}
+
+FrameWriter::~FrameWriter() {
+    close();
+}
+
+bool FrameWriter::close() {
+    if (file == nullptr) return true;
+    bool closed = ownsFile ? fclose(file) == 0 : fflush(file) == 0;
+    file = nullptr;
+    return closed;
+}
+
+size_t FrameWriter::frameBytes() const {
+    return (format == StreamFormat::Y4M ? 6 : 0) + (size_t)w * h * 3;
+}
+
+bool FrameWriter::encode(const Image& frame, std::vector<uint8_t>& bytes) const {
+    // the header has the size of every frame in the stream
+    if (frame.w != w || frame.h != h) {
+        std::cerr<<"A frame of "<<frame.w<<"x"<<frame.h<<" doesn't fit a stream of "<<w<<"x"<<h<<std::endl;
+        bytes.clear();
+        return false;
+    }
+    size_t pixels = (size_t)frame.w * frame.h;
+    if (format != StreamFormat::Y4M) {
+        bytes.resize(pixels * 3);
+        for (size_t i = 0; i < pixels; i++) {
+            for (int channel = 0; channel < 3; channel++) {
+                bytes[i*3 + channel] = frame.data[i*frame.channels + (frame.channels < 3 ? 0 : channel)];
+            }
+        }
+        return true;
+    }
+
+    static const char tag[] = "FRAME\n";
+    bytes.resize(6 + pixels * 3);
+    std::copy(tag, tag + 6, bytes.begin());
+    uint8_t* yPlane = bytes.data() + 6;
+    uint8_t* uPlane = yPlane + pixels;
+    uint8_t* vPlane = uPlane + pixels;
+    const uint8_t* src = frame.data.data();
+    for (size_t i = 0; i < pixels; i++, src += frame.channels) {
+        int r = src[0];
+        int g = frame.channels < 3 ? r : src[1];
+        int b = frame.channels < 3 ? r : src[2];
+        yPlane[i] = clampByte(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+        uPlane[i] = clampByte(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+        vPlane[i] = clampByte(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+    }
+    return true;
+}
+
+bool FrameWriter::write(const std::vector<uint8_t>& bytes) {
+    if (bytes.size() != frameBytes()) return false;
+    return fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+}
@@ -0,0 +1,70 @@
+#ifndef VIDEO_STREAM_H
+#define VIDEO_STREAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "Image.h"
+
+enum class StreamFormat { Y4M, RGB24, GRAY8 };
+
+// "y4m", "rgb24" or "gray8", false if it's none of them
+bool parseStreamFormat(const std::string& name, StreamFormat& format);
+
+// fopen, except that "-" is stdin / stdout (switched to binary), which the caller doesn't own
+FILE* openStream(const std::string& path, const char* mode, bool& owns);
+
+// reads consecutive frames out of a YUV4MPEG2 or headerless RGB24 / GRAY8 stream, "-" is stdin
+// y4m supports 8 bit 420 / 422 / 444 / mono, colour is converted to RGB (BT.601, limited range unless XCOLORRANGE=FULL)
+// and mono stays a single gray channel, raw streams need the frame size from the caller
+class FrameReader {
+public:
+    FrameReader(const std::string& path, StreamFormat format, int w = 0, int h = 0);
+    ~FrameReader();
+
+    bool ok() const { return file != nullptr && w > 0 && h > 0; }
+    bool read(Image& frame); // false at the end of the stream
+
+    int w = 0;
+    int h = 0;
+    uint64_t bytesRead = 0; // frames so far, header lines included
+
+private:
+    bool readHeader();
+    bool readY4MFrame(Image& frame);
+
+    FILE* file = nullptr;
+    bool ownsFile = false;
+    StreamFormat format;
+    std::string chroma = "420jpeg";
+    bool fullRange = false;
+    std::vector<uint8_t> planes;
+};
+
+// writes composited RGB frames as a YUV4MPEG2 (C444, BT.601 limited range) or headerless RGB24 stream, "-" is stdout
+// encode() only converts and can run on any thread, write() must be called in frame order from one thread
+// close() says whether everything made it out, the destructor closes too but can't tell anyone
+class FrameWriter {
+public:
+    FrameWriter(const std::string& path, StreamFormat format, int w, int h, int fps);
+    ~FrameWriter();
+
+    bool ok() const { return file != nullptr; } // false when the file couldn't be opened or its header written
+    bool encode(const Image& frame, std::vector<uint8_t>& bytes) const; // false on a frame of another size than w x h
+    bool write(const std::vector<uint8_t>& bytes); // false on a short write (disk full, closed pipe) or a frame of the wrong size
+    bool close();
+
+    int w;
+    int h;
+
+private:
+    size_t frameBytes() const;
+
+    FILE* file = nullptr;
+    bool ownsFile = false;
+    StreamFormat format;
+};
+
+#endif
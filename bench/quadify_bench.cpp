@@ -0,0 +1,200 @@
+// times the stages of quadifying a frame at several resolutions and prints one CSV row per stage:
+// source,width,height,stage,ns_per_pixel,fps
+// ns_per_pixel is per pixel of the frame (for atlas_* the startup cost of every sprite size the frame can use),
+// fps is how often the stage alone could run per second, both from the fastest of --repeat runs
+// frames are a synthetic pattern and in/img_0.png scaled to each size, sprites come from res/ like in main
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Image.h"
+#include "lib/thread_pool.hpp"
+
+struct BenchOptions {
+    int repeat = 5;
+    unsigned threads = 1; // 1 runs everything on the calling thread, more also splits frames over a pool
+    std::vector<std::pair<int, int>> sizes = { {1280, 720}, {1920, 1080}, {3840, 2160} };
+    std::string input = "in/img_0.png";
+    std::string sprites = "res";
+};
+
+// 720p / 1080p / 4k or WxH
+static bool parseSize(const std::string& name, std::pair<int, int>& size) {
+    if (name == "720p") size = {1280, 720};
+    else if (name == "1080p") size = {1920, 1080};
+    else if (name == "4k") size = {3840, 2160};
+    else return sscanf(name.c_str(), "%dx%d", &size.first, &size.second) == 2 && size.first > 0 && size.second > 0;
+    return true;
+}
+
+static bool parseSizes(const std::string& list, std::vector<std::pair<int, int>>& sizes) {
+    sizes.clear();
+    std::stringstream names(list);
+    std::string name;
+    while (std::getline(names, name, ',')) {
+        std::pair<int, int> size;
+        if (!parseSize(name, size)) return false;
+        sizes.push_back(size);
+    }
+    return !sizes.empty();
+}
+
+// gradients with a checkerboard and a disc, so there are flat, smooth and busy regions to split
+static Image syntheticFrame(int w, int h) {
+    Image frame(w, h, 3);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            uint8_t* pixel = frame.data.data() + ((size_t)y * w + x) * 3;
+            int dx = x - w / 2;
+            int dy = y - h / 2;
+            bool disc = (int64_t)dx * dx + (int64_t)dy * dy < (int64_t)h * h / 9;
+            bool check = (x * 24 / w + y * 16 / h) % 2;
+            pixel[0] = disc ? 255 : x * 255 / w;
+            pixel[1] = disc ? 255 : y * 255 / h;
+            pixel[2] = check ? 200 : 40;
+        }
+    }
+    return frame;
+}
+
+// the per-pixel RGB check reads three channels, so the first channel of a gray frame is spread to all of them
+// (the analysis does the same), alpha is dropped
+static Image toRGB(const Image& frame) {
+    Image rgb(frame.w, frame.h, 3);
+    for (size_t i = 0; i < (size_t)frame.w * frame.h; i++) {
+        for (int channel = 0; channel < 3; channel++) {
+            rgb.data[i * 3 + channel] = frame.data[i * frame.channels + (frame.channels < 3 ? 0 : channel)];
+        }
+    }
+    return rgb;
+}
+
+// fastest of `repeat` runs in nanoseconds
+template <typename F>
+static double fastest(int repeat, const F& run) {
+    double best = 0;
+    for (int i = 0; i < repeat; i++) {
+        auto start = std::chrono::steady_clock::now();
+        run();
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        if (i == 0 || ns < best) best = ns;
+    }
+    return best;
+}
+
+static void report(const std::string& source, const Image& frame, const char* stage, double ns) {
+    std::cout<<source<<","<<frame.w<<","<<frame.h<<","<<stage<<","<<ns / ((double)frame.w * frame.h)<<","<<1e9 / ns<<std::endl;
+}
+
+static void benchFrame(const std::string& source, Image& frame, const std::vector<Image>& sprites, const BenchOptions& options,
+                       thread_pool& atlasPool, work_stealing_pool* pool) {
+    // the per-pixel checks subdivide used before summed-area tables, over a grid of 32 x 32 blocks
+    int checkBW = 0;
+    report(source, frame, "check_bw", fastest(options.repeat, [&] {
+        for (int y = 0; y < frame.h; y += 32) {
+            for (int x = 0; x < frame.w; x += 32) {
+                checkBW += frame.subdivideCheckBW(x, y, std::min(32, frame.w - x), std::min(32, frame.h - y));
+            }
+        }
+    }));
+    int checkRGB = 0;
+    report(source, frame, "check_rgb", fastest(options.repeat, [&] {
+        for (int y = 0; y < frame.h; y += 32) {
+            for (int x = 0; x < frame.w; x += 32) {
+                checkRGB += std::get<1>(frame.subdivideCheckRGB(x, y, std::min(32, frame.w - x), std::min(32, frame.h - y)));
+            }
+        }
+    }));
+    if (checkBW < 0 || checkRGB < 0) std::cerr<<"unreachable, keeps the checks from being optimized out"<<std::endl;
+
+    Quadtree treeBW;
+    Quadtree treeRGB;
+    report(source, frame, "analyze_bw", fastest(options.repeat, [&] { treeBW = frame.analyzeBW(Analysis::Integral, nullptr, pool); }));
+    report(source, frame, "analyze_rgb", fastest(options.repeat, [&] { treeRGB = frame.analyzeRGB(Analysis::Integral, nullptr, pool); }));
+    report(source, frame, "analyze_pyramid_rgb", fastest(options.repeat, [&] { frame.analyzeRGB(Analysis::Pyramid, nullptr, pool); }));
+
+    Image resized;
+    report(source, frame, "resize", fastest(options.repeat, [&] { resized = sprites[0].resizeFastNew(frame.w, frame.h); }));
+
+    SpriteAtlas atlasBW;
+    SpriteAtlas atlasRGB;
+    report(source, frame, "atlas_bw", fastest(options.repeat, [&] {
+        atlasBW = SpriteAtlas(sprites, Image::blockSizes(frame.w, frame.h, splitLimitsBW), atlasPool);
+    }));
+    report(source, frame, "atlas_rgb", fastest(options.repeat, [&] {
+        atlasRGB = SpriteAtlas(sprites, Image::blockSizes(frame.w, frame.h, splitLimitsRGB), atlasPool);
+    }));
+
+    // one tinted sprite over the whole frame, then the drawing of the trees from above
+    Image canvas(frame.w, frame.h, 3);
+    report(source, frame, "overlay", fastest(options.repeat, [&] { canvas.overlay(resized, 0, 0, 0.8f, 0.6f, 0.4f); }));
+    Image drawn;
+    report(source, frame, "render_bw", fastest(options.repeat, [&] { drawn = treeBW.render(atlasBW, 0, nullptr, nullptr, pool); }));
+    report(source, frame, "render_rgb", fastest(options.repeat, [&] { drawn = treeRGB.render(atlasRGB, 0, nullptr, nullptr, pool); }));
+
+    std::vector<uint8_t> png;
+    report(source, frame, "encode", fastest(options.repeat, [&] { drawn.encode(png); }));
+    std::string path = "quadify_bench_" + std::to_string(frame.w) + "x" + std::to_string(frame.h) + ".png";
+    report(source, frame, "write", fastest(options.repeat, [&] { drawn.write(path.c_str()); }));
+    std::remove(path.c_str());
+}
+
+void showUsage() {
+    std::cout<<"Usage: quadify_bench (Options), run from the directory with in/ and res/\n"
+             <<"Options:\n"
+             <<"--repeat N      Runs per stage, the fastest is reported (default 5)\n"
+             <<"--sizes LIST    Comma separated 720p | 1080p | 4k | WxH (default 720p,1080p,4k)\n"
+             <<"--threads N     Threads for the sprite atlas and, above 1, a pool every frame is split over (default 1)\n"
+             <<"--input PATH    Bundled frame scaled to every size (default in/img_0.png, skipped when missing)\n"
+             <<"--sprites DIR   Directory with the sprite frames 0.png - 5.png (default res)"<<std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    BenchOptions options;
+    for (int arg = 1; arg < argc; arg++) {
+        std::string flag = argv[arg];
+        if (flag == "--repeat" && arg + 1 < argc) {
+            options.repeat = std::max(1, std::stoi(argv[++arg]));
+        } else if (flag == "--sizes" && arg + 1 < argc && parseSizes(argv[arg + 1], options.sizes)) {
+            arg++;
+        } else if (flag == "--threads" && arg + 1 < argc) {
+            options.threads = std::max(1, std::stoi(argv[++arg]));
+        } else if (flag == "--input" && arg + 1 < argc) {
+            options.input = argv[++arg];
+        } else if (flag == "--sprites" && arg + 1 < argc) {
+            options.sprites = argv[++arg];
+        } else {
+            showUsage();
+            return 1;
+        }
+    }
+
+    std::vector<Image> sprites;
+    for (int i = 0; i < 6; i++) {
+        Image sprite(0, 0, 0);
+        std::string name = options.sprites + "/" + std::to_string(i) + ".png";
+        if (!sprite.read(name.c_str())) {
+            std::cerr<<"Failed to read "<<name<<std::endl;
+            return 1;
+        }
+        sprites.push_back(std::move(sprite));
+    }
+    Image bundled(0, 0, 0);
+    if (!bundled.read(options.input.c_str())) std::cerr<<"Failed to read "<<options.input<<", only synthetic frames are timed"<<std::endl;
+
+    thread_pool atlasPool(options.threads, true);
+    std::unique_ptr<work_stealing_pool> pool(options.threads > 1 ? new work_stealing_pool(options.threads) : nullptr);
+    std::cout<<"source,width,height,stage,ns_per_pixel,fps"<<std::endl;
+    for (const auto& [w, h] : options.sizes) {
+        Image synthetic = syntheticFrame(w, h);
+        benchFrame("synthetic", synthetic, sprites, options, atlasPool, pool.get());
+        if (bundled.w > 0 && bundled.h > 0) {
+            Image scaled = toRGB(bundled.resizeFastNew(w, h));
+            benchFrame("bundled", scaled, sprites, options, atlasPool, pool.get());
+        }
+    }
+    return 0;
+}
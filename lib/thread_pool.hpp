@@ -14,7 +14,9 @@
 
 #include <atomic>      // std::atomic
 #include <chrono>      // std::chrono
+#include <condition_variable> // std::condition_variable
 #include <cstdint>     // std::int_fast64_t, std::uint_fast32_t
+#include <deque>       // std::deque
 #include <functional>  // std::function
 #include <future>      // std::future, std::promise
 #include <iostream>    // std::cout, std::ostream
@@ -44,9 +46,10 @@ public:
      * @brief Construct a new thread pool.
      *
      * @param _thread_count The number of threads to use. The default value is the total number of hardware threads available, as reported by the implementation. With a hyperthreaded CPU, this will be twice the number of CPU cores. If the argument is zero, the default value will be used instead.
+     * @param _blocking If true, idle workers and wait_for_tasks() block on condition variables and are woken up as soon as a task is pushed or finished, instead of polling with sleep_or_yield(). This removes up to sleep_duration of latency per task and keeps idle threads off the CPU, which matters for short, fine-grained tasks. The default value is false.
      */
-    thread_pool(const ui32 &_thread_count = std::thread::hardware_concurrency())
-        : thread_count(_thread_count ? _thread_count : std::thread::hardware_concurrency()), threads(new std::thread[_thread_count ? _thread_count : std::thread::hardware_concurrency()])
+    thread_pool(const ui32 &_thread_count = std::thread::hardware_concurrency(), const bool &_blocking = false)
+        : blocking(_blocking), thread_count(_thread_count ? _thread_count : std::thread::hardware_concurrency()), threads(new std::thread[_thread_count ? _thread_count : std::thread::hardware_concurrency()])
     {
         create_threads();
     }
@@ -58,6 +61,7 @@ public:
     {
         wait_for_tasks();
         running = false;
+        wake_workers();
         destroy_threads();
     }
 
@@ -106,6 +110,16 @@ public:
         return thread_count;
     }
 
+    /**
+     * @brief Check whether the pool was constructed in blocking mode.
+     *
+     * @return true if workers and wait_for_tasks() block on condition variables, false if they poll.
+     */
+    bool is_blocking() const
+    {
+        return blocking;
+    }
+
     /**
      * @brief Parallelize a loop by splitting it into blocks, submitting each block separately to the thread pool, and waiting for all blocks to finish executing. The loop will be equivalent to: for (T i = first_index; i <= last_index; i++) loop(i);
      *
@@ -115,6 +129,7 @@ public:
      * @param last_index The last index in the loop (inclusive).
      * @param loop The function to loop through. Should take exactly one argument, the loop index.
      * @param num_tasks The maximum number of tasks to split the loop into. The default is to use the number of threads in the pool.
+     * @details In blocking mode the caller sleeps on task_done until the last block is done instead of polling with sleep_or_yield().
      */
     template <typename T, typename F>
     void parallelize_loop(T first_index, T last_index, const F &loop, ui32 num_tasks = 0)
@@ -142,10 +157,18 @@ public:
                               loop(i);
                           blocks_running--;
                       });
-            while (blocks_running != 0)
-            {
-                sleep_or_yield();
-            }
+        }
+        if (blocking)
+        {
+            // a block is counted down before its worker takes queue_mutex to notify task_done, so checking under the lock can't miss it
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            task_done.wait(lock, [&blocks_running]
+                           { return blocks_running == 0; });
+            return;
+        }
+        while (blocks_running != 0)
+        {
+            sleep_or_yield();
         }
     }
 
@@ -163,6 +186,8 @@ public:
             const std::scoped_lock lock(queue_mutex);
             tasks.push(std::function<void()>(task));
         }
+        if (blocking)
+            task_available.notify_one();
     }
 
     /**
@@ -192,12 +217,13 @@ public:
         paused = true;
         wait_for_tasks();
         running = false;
+        wake_workers();
         destroy_threads();
         thread_count = _thread_count ? _thread_count : std::thread::hardware_concurrency();
         threads.reset(new std::thread[thread_count]);
         paused = was_paused;
-        create_threads();
         running = true;
+        create_threads();
     }
 
     /**
@@ -247,6 +273,19 @@ public:
      */
     void wait_for_tasks()
     {
+        if (blocking)
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            while (paused ? tasks_total != tasks.size() : tasks_total != 0)
+            {
+                // paused can be flipped without any notification, so keep checking it every sleep_duration while it is set
+                if (paused)
+                    task_done.wait_for(lock, std::chrono::microseconds(sleep_duration ? sleep_duration : 1000));
+                else
+                    task_done.wait(lock);
+            }
+            return;
+        }
         while (true)
         {
             if (!paused)
@@ -273,7 +312,7 @@ public:
     std::atomic<bool> paused = false;
 
     /**
-     * @brief The duration, in microseconds, that the worker function should sleep for when it cannot find any tasks in the queue. If set to 0, then instead of sleeping, the worker function will execute std::this_thread::yield() if there are no tasks in the queue. The default value is 1000.
+     * @brief The duration, in microseconds, that the worker function should sleep for when it cannot find any tasks in the queue. If set to 0, then instead of sleeping, the worker function will execute std::this_thread::yield() if there are no tasks in the queue. The default value is 1000. In blocking mode this is only used to re-check the paused flag while it is set.
      */
     ui32 sleep_duration = 1000;
 
@@ -335,11 +374,60 @@ private:
             std::this_thread::yield();
     }
 
+    /**
+     * @brief Wake up all workers blocked on an empty queue, so they notice that running was set to false. Taking the mutex first makes sure no worker is between checking running and going to sleep.
+     */
+    void wake_workers()
+    {
+        if (!blocking)
+            return;
+        {
+            const std::scoped_lock lock(queue_mutex);
+        }
+        task_available.notify_all();
+    }
+
+    /**
+     * @brief Blocking mode worker. Sleeps on task_available until a task is pushed or the pool is destroyed, and notifies task_done after every task.
+     */
+    void blocking_worker()
+    {
+        while (true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                while (running && (paused || tasks.empty()))
+                {
+                    if (paused)
+                        task_available.wait_for(lock, std::chrono::microseconds(sleep_duration ? sleep_duration : 1000));
+                    else
+                        task_available.wait(lock);
+                }
+                if (!running)
+                    return;
+                task = std::move(tasks.front());
+                tasks.pop();
+            }
+            task();
+            {
+                const std::scoped_lock lock(queue_mutex);
+                tasks_total--;
+            }
+            task_done.notify_all();
+        }
+    }
+
     /**
      * @brief A worker function to be assigned to each thread in the pool. Continuously pops tasks out of the queue and executes them, as long as the atomic variable running is set to true.
      */
     void worker()
     {
+        if (blocking)
+        {
+            blocking_worker();
+            return;
+        }
         while (running)
         {
             std::function<void()> task;
@@ -359,11 +447,26 @@ private:
     // Private data
     // ============
 
+    /**
+     * @brief Whether workers and wait_for_tasks() block on the condition variables below instead of polling. Fixed at construction.
+     */
+    const bool blocking;
+
     /**
      * @brief A mutex to synchronize access to the task queue by different threads.
      */
     mutable std::mutex queue_mutex;
 
+    /**
+     * @brief Signalled when a task is pushed into the queue (blocking mode only).
+     */
+    std::condition_variable task_available;
+
+    /**
+     * @brief Signalled when a task finishes executing (blocking mode only).
+     */
+    std::condition_variable task_done;
+
     /**
      * @brief An atomic variable indicating to the workers to keep running. When set to false, the workers permanently stop working.
      */
@@ -393,6 +496,420 @@ private:
 //                                     End class thread_pool                                     //
 // ============================================================================================= //
 
+// ============================================================================================= //
+//                                Begin class work_stealing_pool                                 //
+
+/**
+ * @brief A work-stealing variant of thread_pool with the same submit(), push_task() and parallelize_loop() surface. Every worker owns a deque with its own mutex instead of all threads sharing one queue. Tasks pushed from inside a task go to the back of the current worker's deque and are popped from there again (newest first), tasks pushed from any other thread are spread round-robin over the workers. A worker that runs out of tasks steals the oldest task from the front of another worker's deque, and only goes to sleep on a condition variable when no task is queued anywhere. This keeps both frame-level and recursive, fine-grained tasks free of contention on a single queue mutex.
+ * @details There is no pausing and no reset(). wait_for_tasks() must not be called from inside a task, as it would wait for itself; inside a task, use parallelize_loop(), which keeps executing queued tasks while it waits for its own blocks.
+ */
+class work_stealing_pool
+{
+    typedef std::uint_fast32_t ui32;
+
+public:
+    // ============================
+    // Constructors and destructors
+    // ============================
+
+    /**
+     * @brief Construct a new work-stealing pool.
+     *
+     * @param _thread_count The number of threads to use. The default value is the total number of hardware threads available, as reported by the implementation. If the argument is zero, the default value will be used instead.
+     */
+    work_stealing_pool(const ui32 &_thread_count = std::thread::hardware_concurrency())
+        : thread_count(_thread_count ? _thread_count : std::thread::hardware_concurrency()), threads(new std::thread[thread_count]), queues(new worker_queue[thread_count])
+    {
+        for (ui32 i = 0; i < thread_count; i++)
+        {
+            threads[i] = std::thread(&work_stealing_pool::worker, this, i);
+        }
+    }
+
+    /**
+     * @brief Destruct the pool. Waits for all tasks to complete, then wakes up and joins all threads.
+     */
+    ~work_stealing_pool()
+    {
+        wait_for_tasks();
+        running = false;
+        {
+            const std::scoped_lock lock(sleep_mutex);
+        }
+        task_available.notify_all();
+        for (ui32 i = 0; i < thread_count; i++)
+        {
+            threads[i].join();
+        }
+    }
+
+    // =======================
+    // Public member functions
+    // =======================
+
+    /**
+     * @brief Get the number of tasks currently waiting in the deques to be executed by the threads.
+     *
+     * @return The number of queued tasks.
+     */
+    size_t get_tasks_queued() const
+    {
+        return tasks_queued;
+    }
+
+    /**
+     * @brief Get the number of tasks currently being executed by the threads.
+     *
+     * @return The number of running tasks.
+     */
+    ui32 get_tasks_running() const
+    {
+        return tasks_total - (ui32)tasks_queued;
+    }
+
+    /**
+     * @brief Get the total number of unfinished tasks - either still in a deque, or running in a thread.
+     *
+     * @return The total number of tasks.
+     */
+    ui32 get_tasks_total() const
+    {
+        return tasks_total;
+    }
+
+    /**
+     * @brief Get the number of threads in the pool.
+     *
+     * @return The number of threads.
+     */
+    ui32 get_thread_count() const
+    {
+        return thread_count;
+    }
+
+    /**
+     * @brief Parallelize a loop by splitting it into blocks, submitting each block separately to the pool, and waiting for all blocks to finish executing. The loop will be equivalent to: for (T i = first_index; i <= last_index; i++) loop(i); While waiting, the calling thread executes queued tasks itself, so this may be called from inside a task (e.g. recursively). Once nothing is left to take, it sleeps on loop_done until its last block is done instead of spinning.
+     *
+     * @tparam T The type of the loop index. Should be a signed or unsigned integer.
+     * @tparam F The type of the function to loop through.
+     * @param first_index The first index in the loop (inclusive).
+     * @param last_index The last index in the loop (inclusive).
+     * @param loop The function to loop through. Should take exactly one argument, the loop index.
+     * @param num_tasks The maximum number of tasks to split the loop into. The default is to use the number of threads in the pool.
+     */
+    template <typename T, typename F>
+    void parallelize_loop(T first_index, T last_index, const F &loop, ui32 num_tasks = 0)
+    {
+        if (num_tasks == 0)
+            num_tasks = thread_count;
+        if (last_index < first_index)
+            std::swap(last_index, first_index);
+        size_t total_size = last_index - first_index + 1;
+        size_t block_size = total_size / num_tasks;
+        if (block_size == 0)
+        {
+            block_size = 1;
+            num_tasks = (ui32)total_size > 1 ? (ui32)total_size : 1;
+        }
+        std::atomic<ui32> blocks_running = 0;
+        for (ui32 t = 0; t < num_tasks; t++)
+        {
+            T start = (T)(t * block_size + first_index);
+            T end = (t == num_tasks - 1) ? last_index : (T)((t + 1) * block_size + first_index - 1);
+            blocks_running++;
+            push_task([this, start, end, &loop, &blocks_running]
+                      {
+                          for (T i = start; i <= end; i++)
+                              loop(i);
+                          // blocks_running may be gone as soon as it reaches 0, the rest only touches the pool
+                          if (--blocks_running == 0)
+                          {
+                              {
+                                  const std::scoped_lock lock(loop_mutex);
+                              }
+                              loop_done.notify_all();
+                          }
+                      });
+        }
+        while (blocks_running != 0)
+        {
+            if (run_pending_task())
+                continue;
+            // the last block counts down before it takes loop_mutex to notify, so checking under the lock can't miss it
+            std::unique_lock<std::mutex> lock(loop_mutex);
+            loop_done.wait(lock, [&blocks_running]
+                           { return blocks_running == 0; });
+        }
+    }
+
+    /**
+     * @brief Push a function with no arguments or return value into a deque. From inside a task it goes to the current worker's own deque, otherwise to the next worker in round-robin order.
+     *
+     * @tparam F The type of the function.
+     * @param task The function to push.
+     */
+    template <typename F>
+    void push_task(const F &task)
+    {
+        tasks_total++;
+        worker_queue &queue = queues[current_pool == this ? current_index : (ui32)(next_queue++ % thread_count)];
+        {
+            const std::scoped_lock lock(queue.mutex);
+            queue.tasks.push_back(std::function<void()>(task));
+        }
+        tasks_queued++;
+        // pairs with the increment of sleeping in worker(), whichever happens second sees the other
+        if (sleeping != 0)
+        {
+            {
+                const std::scoped_lock lock(sleep_mutex);
+            }
+            task_available.notify_one();
+        }
+    }
+
+    /**
+     * @brief Push a function with arguments, but no return value, into a deque.
+     *
+     * @tparam F The type of the function.
+     * @tparam A The types of the arguments.
+     * @param task The function to push.
+     * @param args The arguments to pass to the function.
+     */
+    template <typename F, typename... A>
+    void push_task(const F &task, const A &...args)
+    {
+        push_task([task, args...]
+                  { task(args...); });
+    }
+
+    /**
+     * @brief Submit a function with zero or more arguments and no return value into a deque, and get an std::future<bool> that will be set to true upon completion of the task.
+     *
+     * @tparam F The type of the function.
+     * @tparam A The types of the zero or more arguments to pass to the function.
+     * @param task The function to submit.
+     * @param args The zero or more arguments to pass to the function.
+     * @return A future to be used later to check if the function has finished its execution.
+     */
+    template <typename F, typename... A, typename = std::enable_if_t<std::is_void_v<std::invoke_result_t<std::decay_t<F>, std::decay_t<A>...>>>>
+    std::future<bool> submit(const F &task, const A &...args)
+    {
+        std::shared_ptr<std::promise<bool>> promise(new std::promise<bool>);
+        std::future<bool> future = promise->get_future();
+        push_task([task, args..., promise]
+                  {
+                      task(args...);
+                      promise->set_value(true);
+                  });
+        return future;
+    }
+
+    /**
+     * @brief Submit a function with zero or more arguments and a return value into a deque, and get a future for its eventual returned value.
+     *
+     * @tparam F The type of the function.
+     * @tparam A The types of the zero or more arguments to pass to the function.
+     * @tparam R The return type of the function.
+     * @param task The function to submit.
+     * @param args The zero or more arguments to pass to the function.
+     * @return A future to be used later to obtain the function's returned value, waiting for it to finish its execution if needed.
+     */
+    template <typename F, typename... A, typename R = std::invoke_result_t<std::decay_t<F>, std::decay_t<A>...>, typename = std::enable_if_t<!std::is_void_v<R>>>
+    std::future<R> submit(const F &task, const A &...args)
+    {
+        std::shared_ptr<std::promise<R>> promise(new std::promise<R>);
+        std::future<R> future = promise->get_future();
+        push_task([task, args..., promise]
+                  { promise->set_value(task(args...)); });
+        return future;
+    }
+
+    /**
+     * @brief Wait for all tasks to be completed, both queued and running. Blocks on a condition variable instead of polling. Must not be called from inside a task.
+     */
+    void wait_for_tasks()
+    {
+        std::unique_lock<std::mutex> lock(done_mutex);
+        task_done.wait(lock, [this]
+                       { return tasks_total == 0; });
+    }
+
+private:
+    /**
+     * @brief A deque of tasks owned by one worker, together with the mutex protecting it.
+     */
+    struct worker_queue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    // ========================
+    // Private member functions
+    // ========================
+
+    /**
+     * @brief Try to take a task: first the newest one from the current worker's own deque, then the oldest one from any other deque.
+     *
+     * @param task A reference to the task. Will be populated with a function if one was found.
+     * @return true if a task was found, false if all deques are empty.
+     */
+    bool pop_task(std::function<void()> &task)
+    {
+        bool own = current_pool == this;
+        if (own)
+        {
+            worker_queue &queue = queues[current_index];
+            const std::scoped_lock lock(queue.mutex);
+            if (!queue.tasks.empty())
+            {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+                tasks_queued--;
+                return true;
+            }
+        }
+        ui32 first = own ? current_index + 1 : 0;
+        for (ui32 i = 0; i < thread_count; i++)
+        {
+            worker_queue &queue = queues[(first + i) % thread_count];
+            const std::scoped_lock lock(queue.mutex);
+            if (!queue.tasks.empty())
+            {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+                tasks_queued--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief Execute one queued task on the calling thread, if there is one.
+     *
+     * @return true if a task was executed.
+     */
+    bool run_pending_task()
+    {
+        std::function<void()> task;
+        if (!pop_task(task))
+            return false;
+        task();
+        finish_task();
+        return true;
+    }
+
+    /**
+     * @brief Count a task as done, and wake up wait_for_tasks() if it was the last one.
+     */
+    void finish_task()
+    {
+        if (--tasks_total == 0)
+        {
+            {
+                const std::scoped_lock lock(done_mutex);
+            }
+            task_done.notify_all();
+        }
+    }
+
+    /**
+     * @brief A worker function to be assigned to each thread in the pool. Executes tasks from its own deque or stolen from others, and sleeps on task_available while nothing is queued anywhere.
+     *
+     * @param index The index of this worker's deque.
+     */
+    void worker(ui32 index)
+    {
+        current_pool = this;
+        current_index = index;
+        while (true)
+        {
+            if (run_pending_task())
+                continue;
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            sleeping++;
+            task_available.wait(lock, [this]
+                                { return tasks_queued != 0 || !running; });
+            sleeping--;
+            if (!running && tasks_queued == 0)
+                return;
+        }
+    }
+
+    // ============
+    // Private data
+    // ============
+
+    /**
+     * @brief The pool the current thread works for, if any, and the index of its deque. Used to push and pop on the thread's own deque.
+     */
+    inline static thread_local work_stealing_pool *current_pool = nullptr;
+    inline static thread_local ui32 current_index = 0;
+
+    /**
+     * @brief The number of threads in the pool.
+     */
+    ui32 thread_count;
+
+    /**
+     * @brief A smart pointer to manage the memory allocated for the threads.
+     */
+    std::unique_ptr<std::thread[]> threads;
+
+    /**
+     * @brief One deque per worker.
+     */
+    std::unique_ptr<worker_queue[]> queues;
+
+    /**
+     * @brief Round-robin counter for tasks pushed from outside the pool.
+     */
+    std::atomic<ui32> next_queue = 0;
+
+    /**
+     * @brief The number of tasks sitting in any of the deques.
+     */
+    std::atomic<size_t> tasks_queued = 0;
+
+    /**
+     * @brief The total number of unfinished tasks - either still in a deque, or running in a thread.
+     */
+    std::atomic<ui32> tasks_total = 0;
+
+    /**
+     * @brief The number of workers asleep (or about to be) on task_available.
+     */
+    std::atomic<ui32> sleeping = 0;
+
+    /**
+     * @brief An atomic variable indicating to the workers to keep running. When set to false, the workers exit once nothing is queued.
+     */
+    std::atomic<bool> running = true;
+
+    /**
+     * @brief Mutex and condition variable idle workers sleep on. Only touched when a worker has nothing left to steal.
+     */
+    std::mutex sleep_mutex;
+    std::condition_variable task_available;
+
+    /**
+     * @brief Mutex and condition variable wait_for_tasks() sleeps on.
+     */
+    std::mutex done_mutex;
+    std::condition_variable task_done;
+
+    /**
+     * @brief Mutex and condition variable parallelize_loop() sleeps on once all of its blocks are taken, notified whenever the last block of any loop is done.
+     */
+    std::mutex loop_mutex;
+    std::condition_variable loop_done;
+};
+
+//                                 End class work_stealing_pool                                  //
+// ============================================================================================= //
+
 // ============================================================================================= //
 //                                   Begin class synced_stream                                   //
 
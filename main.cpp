@@ -1,28 +1,243 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <filesystem>
 
-#include "lib/thread_pool.hpp"
 #include "Image.h"
+#include "Pipeline.h"
+#include "VideoStream.h"
+#include "QuadtreeStream.h"
+#include "Stats.h"
+#include "lib/thread_pool.hpp"
+
+// settings from the optional --flags after the positional arguments
+struct Options {
+    Analysis analysis = Analysis::Integral;
+    size_t tintCache = 0; // tinted sprites kept per worker thread, 0 tints while drawing
+    bool temporal = false; // reuse the unchanged blocks of the last frame quadified with the same sprites
+    size_t dedupe = 0; // distinct (content, sprite frame) outputs remembered for repeated frames, 0 renders every frame
+    bool resume = false; // skip the frames whose out/img_#.png is already complete
+
+    // pipeline stage sizes, decoding and writing are mostly waiting on zlib / the disk
+    unsigned decodeThreads = std::max(1u, std::thread::hardware_concurrency() / 4);
+    unsigned quadifyThreads = std::max(1u, std::thread::hardware_concurrency() / 2);
+    unsigned encodeThreads = std::max(1u, std::thread::hardware_concurrency() / 2);
+    unsigned writeThreads = 1;
+    size_t queueSize = std::max(2u, std::thread::hardware_concurrency());
+    unsigned frameThreads = 0; // a pool that also splits every single frame up, for stills and short ranges
+
+    // read frames from a y4m / raw stream instead of in/img_#.png, "-" is stdin
+    std::string input;
+    StreamFormat inputFormat = StreamFormat::Y4M;
+    int inputWidth = 0;
+    int inputHeight = 0;
+
+    // write every frame in order into one y4m / rgb24 stream instead of out/img_#.png, "-" is stdout
+    std::string output;
+    StreamFormat outputFormat = StreamFormat::Y4M;
+    int fps = 25;
+
+    // write the quadtrees of all frames in order into a .qts file instead of drawing them, "-" is stdout
+    std::string quadtrees;
+    std::string sprites = "res"; // sprite frames are <sprites>/0.png, 1.png ...
+    SpriteFilter spriteFilter = SpriteFilter::Nearest;
+    std::string spriteCache; // directory for resized sprite sets, empty resizes on every run
+
+    // PNG output, stb's defaults unless asked for something faster
+    int pngLevel = 8;
+    int pngFilter = -1;
+
+    std::string stats; // per-stage times and counters of every frame as JSON once the run is done, "-" is stderr
+    std::string trace; // every stage of every frame and the waits in between on a timeline per thread, "-" is stderr
+
+    // progress goes to stderr when stdout carries the video
+    std::ostream& log() const { return output == "-" || quadtrees == "-" ? std::cerr : std::cout; }
+};
+
+// the output of the first frame with some (content, sprite frame), shared with the repeats of it
+struct SharedOutput {
+    int i;
+    std::vector<uint8_t> bytes;
+    Quadtree tree;
+    std::atomic<bool> ready{false};   // bytes / tree are set
+    std::atomic<bool> written{false}; // out/img_i.png exists and can be linked
+};
+
+// one frame on its way through the pipeline
+struct FrameJob {
+    int i = 0;
+    int index = 0; // sprite frame
+    Image frame = Image(0, 0, 0); // empty when the frame couldn't be read, it still has to pass so an ordered writer can move on
+    std::vector<uint8_t> bytes; // PNG file or raw stream frame
+    Quadtree tree; // only kept for a .qts file
+    std::shared_ptr<SharedOutput> output; // with --dedupe, repeats skip quadify / encode and copy this
+    bool producer = false; // the frame that fills output in
+
+    bool repeat() const { return output && !producer; }
+    bool ready() const { return !repeat() || output->ready; }
+    const std::vector<uint8_t>& result() const { return repeat() ? output->bytes : bytes; }
+    const Quadtree& quadtree() const { return repeat() ? output->tree : tree; }
+};
+
+// LRU of the outputs of recent distinct frames keyed by content hash and sprite frame
+// a repeat found here keeps its SharedOutput alive even after it's evicted
+class OutputCache {
+public:
+    OutputCache(size_t capacity) : capacity(capacity) {}
+
+    // the output to copy for a repeat, or a new one this frame has to produce
+    std::shared_ptr<SharedOutput> claim(uint64_t hash, int index, int i, bool& producer) {
+        std::scoped_lock lock(mutex);
+        Key key(hash, index);
+        auto found = lookup.find(key);
+        if (found != lookup.end()) {
+            entries.splice(entries.begin(), entries, found->second);
+            producer = false;
+            return found->second->second;
+        }
+
+        if (entries.size() >= capacity && !entries.empty()) {
+            lookup.erase(entries.back().first);
+            entries.pop_back();
+        }
+        std::shared_ptr<SharedOutput> output(new SharedOutput);
+        output->i = i;
+        entries.emplace_front(key, output);
+        lookup[key] = entries.begin();
+        producer = true;
+        return output;
+    }
+
+private:
+    typedef std::pair<uint64_t, int> Key;
+
+    std::mutex mutex;
+    size_t capacity;
+    std::list<std::pair<Key, std::shared_ptr<SharedOutput>>> entries; // most recently used first
+    std::map<Key, std::list<std::pair<Key, std::shared_ptr<SharedOutput>>>::iterator> lookup;
+};
+
+// a quadified frame kept around so later frames with the same sprites can reuse its unchanged blocks
+struct RenderedFrame {
+    int i;
+    QuadifiedFrame frame;
+};
 
-void workBW(int i, int index, std::vector<std::map<std::pair<int, int>, Image>>& preloadedResized);
-void workCol(int i, int index, std::vector<std::map<std::pair<int, int>, Image>>& preloadedResized);
+// one frame of a .qts file on its way to being drawn, n counts the frames in the file
+struct TreeJob {
+    int n = 0;
+    int i = 0;
+    int index = 0;
+    Quadtree tree;
+    std::vector<uint8_t> bytes;
+};
 
-void createVideoFramesBW(int start, int end, int repeatFrames);
-void createVideoFramesCol(int start, int end, int repeatFrames);
+// the analysis of a mode, drawing the tree is the same for both
+typedef Quadtree (*Work)(Image& frame, const Options& options, FrameDelta* delta, work_stealing_pool* pool);
+
+Quadtree workBW(Image& frame, const Options& options, FrameDelta* delta, work_stealing_pool* pool);
+Quadtree workCol(Image& frame, const Options& options, FrameDelta* delta, work_stealing_pool* pool);
+
+// false when the output couldn't be opened or written
+bool runPipeline(int start, int end, int repeatFrames, const SpriteAtlas& sprites, const Options& options, Work work, FrameReader* reader, FrameWriter* writer, QuadtreeWriter* quadtrees);
+bool renderQuadtrees(const std::string& path, const Options& options);
+
+bool createVideoFrames(int start, int end, int repeatFrames, const Options& options, Work work, SplitLimits limits);
+SpriteAtlas loadSprites(const Options& options, int count, const std::vector<std::pair<int, int>>& sizes);
+bool createVideoFramesBW(int start, int end, int repeatFrames, const Options& options);
+bool createVideoFramesCol(int start, int end, int repeatFrames, const Options& options);
+std::string outputName(int i);
+bool outputComplete(int i);
+bool writeOutput(int i, const std::vector<uint8_t>& bytes);
+void removeStaleOutputs();
+void reportUnwritten(int count);
+
+// a stage blocked on its queues or the reorder window, only shows up in a --trace: the gaps between the stage spans
+// of a thread are these waits, and which one it is says whether the stage before or after held it up
+template <typename T>
+bool popJob(BoundedQueue<T>& queue, T& job, Stats* stats) {
+    uint64_t started = Stats::now();
+    bool popped = queue.pop(job);
+    if (stats) stats->span("wait for input", popped ? job.i : -1, started);
+    return popped;
+}
+
+template <typename T>
+void pushJob(BoundedQueue<T>& queue, T&& job, Stats* stats) {
+    uint64_t started = Stats::now();
+    int i = job.i;
+    queue.push(std::move(job));
+    if (stats) stats->span("wait for output", i, started);
+}
+
+void admitJob(ReorderWindow& window, int i, Stats* stats) {
+    uint64_t started = Stats::now();
+    window.admit(i);
+    if (stats) stats->span("wait for writer", i, started);
+}
+
+// "auto" lets stb try every filter on every row, the rest force one
+bool parsePngFilter(const std::string& name, int& filter) {
+    static const char* names[] = { "none", "sub", "up", "average", "paeth" };
+    for (int i = 0; i < 5; i++) {
+        if (name == names[i]) {
+            filter = i;
+            return true;
+        }
+    }
+    if (name != "auto") return false;
+    filter = -1;
+    return true;
+}
 
 void showUsage() {
-    std::cout<<"Usage: [?.exe] [BW | Col] [Start] [End] (SFRC)\n"
+    std::cout<<"Usage: [?.exe] [BW | Col] [Start] [End] (SFRC) (Options)\n"
+             <<"       [?.exe] Render [File] (Options)\n"
              <<"BW | Col:   Black and White or Colored Image Sequence\n"
+             <<"Render:     Draw the frames of a .qts file written with --qts\n"
              <<"Start:      Frame to start on (int)\n"
-             <<"End:        Frame to end on (int)\n"
-             <<"SFRC:       How often to repeat Sprite frames (optional, default 2)"<<std::endl;
+             <<"End:        Frame to end on (int, -1 reads an input stream until it ends)\n"
+             <<"SFRC:       How often to repeat Sprite frames (optional, default 2)\n"
+             <<"Options:\n"
+             <<"--pyramid       Analyse frames bottom-up with a block pyramid instead of a summed-area table\n"
+             <<"--tint-cache N  Keep up to N tinted sprites per thread, pays off in BW mode (default 0, tint while drawing)\n"
+             <<"--temporal      Copy blocks that didn't change since the last frame with the same sprite instead of redrawing them\n"
+             <<"--dedupe N      Remember the last N distinct frames, repeats of them are linked / copied instead of rendered\n"
+             <<"--resume        Skip the frames whose out/img_#.png is already complete, for rerunning a job that died\n"
+             <<"--decode-threads N | --quadify-threads N | --encode-threads N | --write-threads N\n"
+             <<"                Threads per pipeline stage (default: cores/4, cores/2, cores/2, 1)\n"
+             <<"--queue N       Frames allowed to wait between two stages (default: cores)\n"
+             <<"--frame-threads N   Also split the analysis and drawing of every frame over N threads (default 0, off)\n"
+             <<"--input PATH    Read frames from a stream (- for stdin) instead of in/img_#.png, numbered from Start\n"
+             <<"--input-format y4m | rgb24 | gray8   Format of the input stream (default y4m)\n"
+             <<"--size WxH      Frame size of a raw rgb24 / gray8 input stream, or the size Render draws at (default the file's)\n"
+             <<"--output PATH   Write all frames in order into one stream (- for stdout) instead of out/img_#.png\n"
+             <<"--output-format y4m | rgb24   Format of the output stream (default y4m, 4:4:4)\n"
+             <<"--fps N         Frame rate written into the y4m header (default 25)\n"
+             <<"--qts PATH      Write the quadtrees of all frames in order into one file (- for stdout) instead of drawing them\n"
+             <<"--sprites DIR   Directory with the sprite frames 0.png - 5.png (default res)\n"
+             <<"--sprite-filter nearest | area   Resize sprites nearest neighbour or box filtered from a mip chain (default nearest)\n"
+             <<"--sprite-cache DIR   Keep resized sprite sets in DIR and load them from there on later runs\n"
+             <<"--png-level N | store   PNG deflate level 1-9 (default 8), 0 or store writes uncompressed PNGs\n"
+             <<"--png-filter auto | none | sub | up | average | paeth   PNG row filter (default auto, tries all per row)\n"
+             <<"--stats PATH    Write per-frame stage times, leaves, depth and bytes read / written with p50 / p99 as JSON (- for stderr)\n"
+             <<"--trace PATH    Write a Chrome / Perfetto trace of every stage and queue wait per frame and thread (- for stderr)"<<std::endl;
 }
 
 int main(int argc, char *argv[0]) {
     std::string type;
-    int start, end, repeatFrames;
-    if (argc < 4) {
+    std::string file;
+    int start = 0, end = 0, repeatFrames = 2;
+    Options options;
+    int arg = 4;
+    if (argc >= 3 && std::string(argv[1]) == "Render") {
+        type = argv[1];
+        file = argv[2];
+        arg = 3;
+    } else if (argc < 4) {
         showUsage();
         return 0;
     } else {
@@ -31,92 +246,613 @@ int main(int argc, char *argv[0]) {
         end = std::stoi(argv[3]);
         repeatFrames = 2;
     }
-    if (argc > 4) {
-        repeatFrames = std::stoi(argv[4]);
+    if (type != "Render" && argc > arg && std::string(argv[arg]).rfind("--", 0) != 0) {
+        repeatFrames = std::stoi(argv[arg++]);
+    }
+    for (; arg < argc; arg++) {
+        std::string flag = argv[arg];
+        if (flag == "--pyramid") {
+            options.analysis = Analysis::Pyramid;
+        } else if (flag == "--temporal") {
+            options.temporal = true;
+        } else if (flag == "--resume") {
+            options.resume = true;
+        } else if (flag == "--dedupe" && arg + 1 < argc) {
+            options.dedupe = std::stoul(argv[++arg]);
+        } else if (flag == "--tint-cache" && arg + 1 < argc) {
+            options.tintCache = std::stoul(argv[++arg]);
+        } else if (flag == "--decode-threads" && arg + 1 < argc) {
+            options.decodeThreads = std::stoul(argv[++arg]);
+        } else if (flag == "--quadify-threads" && arg + 1 < argc) {
+            options.quadifyThreads = std::stoul(argv[++arg]);
+        } else if (flag == "--encode-threads" && arg + 1 < argc) {
+            options.encodeThreads = std::stoul(argv[++arg]);
+        } else if (flag == "--write-threads" && arg + 1 < argc) {
+            options.writeThreads = std::stoul(argv[++arg]);
+        } else if (flag == "--queue" && arg + 1 < argc) {
+            options.queueSize = std::stoul(argv[++arg]);
+        } else if (flag == "--frame-threads" && arg + 1 < argc) {
+            options.frameThreads = std::stoul(argv[++arg]);
+        } else if (flag == "--input" && arg + 1 < argc) {
+            options.input = argv[++arg];
+        } else if (flag == "--input-format" && arg + 1 < argc && parseStreamFormat(argv[arg + 1], options.inputFormat)) {
+            arg++;
+        } else if (flag == "--size" && arg + 1 < argc && sscanf(argv[arg + 1], "%dx%d", &options.inputWidth, &options.inputHeight) == 2) {
+            arg++;
+        } else if (flag == "--output" && arg + 1 < argc) {
+            options.output = argv[++arg];
+        } else if (flag == "--output-format" && arg + 1 < argc && parseStreamFormat(argv[arg + 1], options.outputFormat) && options.outputFormat != StreamFormat::GRAY8) {
+            arg++;
+        } else if (flag == "--fps" && arg + 1 < argc) {
+            options.fps = std::stoi(argv[++arg]);
+        } else if (flag == "--qts" && arg + 1 < argc) {
+            options.quadtrees = argv[++arg];
+        } else if (flag == "--sprites" && arg + 1 < argc) {
+            options.sprites = argv[++arg];
+        } else if (flag == "--sprite-filter" && arg + 1 < argc && (std::string(argv[arg + 1]) == "nearest" || std::string(argv[arg + 1]) == "area")) {
+            options.spriteFilter = std::string(argv[++arg]) == "area" ? SpriteFilter::Area : SpriteFilter::Nearest;
+        } else if (flag == "--sprite-cache" && arg + 1 < argc) {
+            options.spriteCache = argv[++arg];
+        } else if (flag == "--png-level" && arg + 1 < argc) {
+            arg++;
+            options.pngLevel = std::string(argv[arg]) == "store" ? 0 : std::stoi(argv[arg]);
+        } else if (flag == "--png-filter" && arg + 1 < argc && parsePngFilter(argv[arg + 1], options.pngFilter)) {
+            arg++;
+        } else if (flag == "--stats" && arg + 1 < argc) {
+            options.stats = argv[++arg];
+        } else if (flag == "--trace" && arg + 1 < argc) {
+            options.trace = argv[++arg];
+        } else {
+            showUsage();
+            return 0;
+        }
+    }
+    Image::setPngCompression(options.pngLevel, options.pngFilter);
+    if (options.resume && (!options.output.empty() || !options.quadtrees.empty())) {
+        std::cerr<<"--resume only skips out/img_#.png files, a stream is always written from the start"<<std::endl;
+        options.resume = false;
     }
+    if (options.resume) removeStaleOutputs();
 
-    if (type == "BW") {
-        createVideoFramesBW(start, end, repeatFrames);
+    bool done;
+    if (type == "Render") {
+        done = renderQuadtrees(file, options);
+    } else if (type == "BW") {
+        done = createVideoFramesBW(start, end, repeatFrames, options);
     } else if (type == "Col") {
-        createVideoFramesCol(start, end, repeatFrames);
+        done = createVideoFramesCol(start, end, repeatFrames, options);
     } else {
         showUsage();
         return 0;
     }
 
-    std::cout<<"\n\nDone"<<std::endl;
-    return 0;
+    options.log()<<(done ? "\n\nDone" : "\n\nFailed")<<std::endl;
+    return done ? 0 : 1;
 }
 
 
-void createVideoFramesBW(int start, int end, int repeatFrames) {
+bool createVideoFramesBW(int start, int end, int repeatFrames, const Options& options) {
+    return createVideoFrames(start, end, repeatFrames, options, workBW, splitLimitsBW);
+}
 
-    std::vector<std::map<std::pair<int, int>, Image>> preloadedResized;
-    int width;
-    int height;
-    std::string first_name("in/img_" + std::to_string(start) + ".png");
-    Image first_frame(first_name.c_str());
-    width = first_frame.w;
-    height = first_frame.h;
+Quadtree workBW(Image& frame, const Options& options, FrameDelta* delta, work_stealing_pool* pool) {
+    return frame.analyzeBW(options.analysis, delta, pool);
+}
 
-    for (int i = 0; i < 6; i++) {
-        std::string amogus_name("res/" + std::to_string(i) + ".png");
-        Image amogus(amogus_name.c_str());
+bool createVideoFramesCol(int start, int end, int repeatFrames, const Options& options) {
+    return createVideoFrames(start, end, repeatFrames, options, workCol, splitLimitsRGB);
+}
+
+Quadtree workCol(Image& frame, const Options& options, FrameDelta* delta, work_stealing_pool* pool) {
+    return frame.analyzeRGB(options.analysis, delta, pool);
+}
+
+// <sprites>/0.png ... resized to every size, mapped in from the --sprite-cache file for these sprite files, filter and sizes
+// (the sizes follow from the frame size) when there is one, built and saved there otherwise
+// the resizing runs on a pool of its own that's gone again before the pipeline starts
+SpriteAtlas loadSprites(const Options& options, int count, const std::vector<std::pair<int, int>>& sizes) {
+    std::vector<std::string> names;
+    for (int i = 0; i < count; i++) {
+        names.push_back(options.sprites + "/" + std::to_string(i) + ".png");
+    }
 
-        preloadedResized.push_back(amogus.preloadResized(width, height));
+    std::string cached;
+    if (!options.spriteCache.empty() && !sizes.empty()) {
+        uint64_t key = hashBytes((const uint8_t*)sizes.data(), sizes.size() * sizeof(sizes[0]), (uint64_t)options.spriteFilter);
+        for (const std::string& name : names) {
+            std::ifstream in(name, std::ios::binary);
+            std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            key = hashBytes(bytes.data(), bytes.size(), key);
+        }
+        char file[32];
+        snprintf(file, sizeof(file), "%016llx.atlas", (unsigned long long)key);
+        cached = options.spriteCache + "/" + file;
+    }
+
+    SpriteAtlas sprites;
+    if (!cached.empty() && sprites.load(cached)) return sprites;
+
+    // a .qts file only needs the number of sprite frames
+    std::vector<Image> amogi;
+    for (const std::string& name : names) {
+        amogi.push_back(sizes.empty() ? Image(0, 0, 0) : Image(name.c_str()));
+    }
+    {
+        thread_pool pool(0, true); // short resize tasks in three loops one after another
+        sprites = SpriteAtlas(amogi, sizes, pool, options.spriteFilter);
+    }
+    if (!cached.empty()) {
+        std::error_code error;
+        std::filesystem::create_directories(options.spriteCache, error);
+        if (!sprites.save(cached)) std::cerr<<"Failed to write "<<cached<<std::endl;
     }
+    return sprites;
+}
 
-    thread_pool pool;
+std::string outputName(int i) {
+    return "out/img_" + std::to_string(i) + ".png";
+}
 
-    for (int i = start; i <= end; i++) {
-        int index = floor((i % (6*repeatFrames))/repeatFrames);
-        pool.submit(workBW, i, index, std::ref(preloadedResized));
+// every output is renamed into place once it's written, so one that exists is complete unless it's left over from
+// something that wrote in place, which the PNG's closing IEND chunk gives away
+bool outputComplete(int i) {
+    static const uint8_t iend[12] = { 0, 0, 0, 0, 'I', 'E', 'N', 'D', 0xae, 0x42, 0x60, 0x82 };
+    std::ifstream in(outputName(i), std::ios::binary | std::ios::ate);
+    if (!in || (size_t)in.tellg() < 8 + sizeof(iend)) return false;
+    uint8_t last[sizeof(iend)];
+    in.seekg(-(int)sizeof(iend), std::ios::end);
+    return in.read((char*)last, sizeof(last)) && memcmp(last, iend, sizeof(iend)) == 0;
+}
+
+// written next to the output and renamed over it, so a job that dies never leaves half a frame behind
+bool writeOutput(int i, const std::vector<uint8_t>& bytes) {
+    std::string name = outputName(i);
+    std::string temporary = name + ".tmp";
+    std::ofstream out(temporary, std::ios::binary);
+    out.write((const char*)bytes.data(), bytes.size());
+    out.close();
+    std::error_code error;
+    if (out) std::filesystem::rename(temporary, name, error);
+    if (!out || error) {
+        std::cerr<<"Failed to write "<<name<<std::endl;
+        std::filesystem::remove(temporary, error);
+        return false;
     }
+    return true;
+}
 
-    pool.wait_for_tasks();
+// the .tmp files a job left in out/ when it died mid-write, collected first so the directory isn't changed while listing it
+void removeStaleOutputs() {
+    std::error_code error;
+    std::vector<std::filesystem::path> stale;
+    for (const auto& entry : std::filesystem::directory_iterator("out", error)) {
+        if (entry.path().extension() == ".tmp") stale.push_back(entry.path());
+    }
+    for (const auto& path : stale) {
+        if (!std::filesystem::remove(path, error)) std::cerr<<"Failed to remove "<<path.string()<<std::endl;
+    }
 }
 
-void workBW(int i, int index, std::vector<std::map<std::pair<int, int>, Image>>& preloadedResized) {
-    std::string frame_name("in/img_" + std::to_string(i) + ".png");
-    Image frame(frame_name.c_str());
-    Image frame_done = frame.quadifyFrameBW(preloadedResized.at(index));
-    std::string save_loc("out/img_" + std::to_string(i) + ".png");
-    frame_done.write(save_loc.c_str());
-    std::cout<<i<<"\n";
+// a PNG that couldn't be written doesn't stop the others, the run fails at the end and says how to fill the gaps
+void reportUnwritten(int count) {
+    std::cerr<<count<<(count == 1 ? " frame" : " frames")<<" couldn't be written to out/, run again with --resume to redo only those"<<std::endl;
 }
 
-void createVideoFramesCol(int start, int end, int repeatFrames) {
+bool createVideoFrames(int start, int end, int repeatFrames, const Options& options, Work work, SplitLimits limits) {
 
-    std::vector<std::map<std::pair<int, int>, Image>> preloadedResized;
+    std::unique_ptr<FrameReader> reader;
     int width;
     int height;
-    std::string first_name("in/img_" + std::to_string(start) + ".png");
-    Image first_frame(first_name.c_str());
-    width = first_frame.w;
-    height = first_frame.h;
+    if (options.input.empty()) {
+        std::string first_name("in/img_" + std::to_string(start) + ".png");
+        Image first_frame(first_name.c_str());
+        width = first_frame.w;
+        height = first_frame.h;
+    } else {
+        reader.reset(new FrameReader(options.input, options.inputFormat, options.inputWidth, options.inputHeight));
+        if (!reader->ok()) return false;
+        width = reader->w;
+        height = reader->h;
+    }
 
-    for (int i = 0; i < 6; i++) {
-        std::string amogus_name("res/" + std::to_string(i) + ".png");
-        Image amogus(amogus_name.c_str());
+    std::vector<std::pair<int, int>> sizes;
+    if (options.quadtrees.empty()) sizes = Image::blockSizes(width, height, limits);
+    SpriteAtlas sprites = loadSprites(options, 6, sizes);
 
-        preloadedResized.push_back(amogus.preloadResized(width, height));
+    std::unique_ptr<FrameWriter> writer;
+    std::unique_ptr<QuadtreeWriter> quadtrees;
+    if (!options.quadtrees.empty()) {
+        quadtrees.reset(new QuadtreeWriter(options.quadtrees, width, height, sprites.frames()));
+        if (!quadtrees->ok()) return false;
+    } else if (!options.output.empty()) {
+        writer.reset(new FrameWriter(options.output, options.outputFormat, width, height, options.fps));
+        if (!writer->ok()) return false;
     }
 
-    thread_pool pool;
+    return runPipeline(start, end, repeatFrames, sprites, options, work, reader.get(), writer.get(), quadtrees.get());
+}
 
-    for (int i = start; i <= end; i++) {
-        int index = floor((i % (6*repeatFrames))/repeatFrames);
-        pool.submit(workCol, i, index, std::ref(preloadedResized));
-    }
+// decode -> quadify -> encode -> write, every stage with its own threads and a bounded queue in between
+// a full queue stalls the stage before it, so at most a few frames per stage are ever in memory
+// a stream can only be read in order, so it gets a single decode thread
+// a stream or .qts writer needs frames in order too: one write thread puts them back in order and decoding is held
+// back while the frame it waits for is too far behind, which keeps the reorder buffer small
+// with --temporal every sprite frame remembers the newest frame quadified with it, quadify threads diff against
+// whatever is newest when they start, reuse is exact so the output doesn't depend on which frame that is
+// with --qts frames are only analysed and their trees go to the writer, which delta codes them in order
+// with --dedupe decoded frames are hashed and repeats of a recent frame go straight to the writer, which holds
+// them back (without blocking) until the frame they repeat has been encoded
+// a stream / .qts write that fails stops decoding, the frames already on their way are drained without being written
+bool runPipeline(int start, int end, int repeatFrames, const SpriteAtlas& sprites, const Options& options, Work work, FrameReader* reader, FrameWriter* writer, QuadtreeWriter* quadtrees) {
+    BoundedQueue<FrameJob> decoded(options.queueSize);
+    BoundedQueue<FrameJob> rendered(options.queueSize);
+    BoundedQueue<FrameJob> encoded(options.queueSize);
+    ReorderWindow window(start, options.queueSize * 3 + options.decodeThreads + options.quadifyThreads + options.encodeThreads);
+    std::atomic<int> next(start);
+    std::mutex historyMutex;
+    OutputCache outputs(options.dedupe);
+    std::vector<std::shared_ptr<const RenderedFrame>> history(sprites.frames());
+    bool ordered = writer || quadtrees;
+    // shared by every quadify thread, which take part in their frame's loops and sleep once only workers have work left
+    std::unique_ptr<work_stealing_pool> pool(options.frameThreads ? new work_stealing_pool(options.frameThreads) : nullptr);
+    std::atomic<int> skipped(0);
+    std::atomic<int> unwritten(0); // PNGs that couldn't be written, the other frames still are
+    std::atomic<bool> failed(false);
+    std::unique_ptr<Stats> stats(options.stats.empty() && options.trace.empty() ? nullptr : new Stats(!options.trace.empty()));
+
+    // with --resume a frame that's already done isn't even decoded, a stream still has to be read past it
+    Stage decode(reader ? 1 : options.decodeThreads, [&] {
+        if (stats) stats->thread("decode");
+        if (reader) {
+            for (int i = start; (end < 0 || i <= end) && !failed; i++) {
+                FrameJob job;
+                job.i = i;
+                job.index = (i % (6*repeatFrames))/repeatFrames;
+                if (ordered) admitJob(window, i, stats.get());
+                uint64_t started = Stats::now();
+                uint64_t bytesRead = reader->bytesRead;
+                if (!reader->read(job.frame)) break;
+                if (stats) {
+                    stats->time(i, Stat::Decode, started);
+                    stats->record(i, Stat::BytesRead, reader->bytesRead - bytesRead);
+                }
+                if (options.resume && outputComplete(i)) {
+                    skipped++;
+                    continue;
+                }
+                if (options.dedupe) job.output = outputs.claim(job.frame.hash(), job.index, job.i, job.producer);
+                pushJob(decoded, std::move(job), stats.get());
+            }
+            return;
+        }
+        for (int i = next++; i <= end && !failed; i = next++) {
+            if (options.resume && outputComplete(i)) {
+                skipped++;
+                continue;
+            }
+            if (ordered) admitJob(window, i, stats.get());
+            std::string frame_name("in/img_" + std::to_string(i) + ".png");
+            uint64_t started = Stats::now();
+            FrameJob job;
+            job.i = i;
+            job.index = (i % (6*repeatFrames))/repeatFrames;
+            job.frame = Image(frame_name.c_str());
+            if (stats && job.frame.size != 0) {
+                std::error_code error;
+                stats->time(i, Stat::Decode, started);
+                stats->record(i, Stat::BytesRead, std::filesystem::file_size(frame_name, error));
+            }
+            if (options.dedupe && job.frame.size != 0) job.output = outputs.claim(job.frame.hash(), job.index, job.i, job.producer);
+            pushJob(decoded, std::move(job), stats.get());
+        }
+    });
+
+    Stage quadify(options.quadifyThreads, [&] {
+        if (stats) stats->thread("quadify");
+        thread_local TintCache tintCache(options.tintCache);
+        TintCache* tints = options.tintCache ? &tintCache : nullptr;
+        FrameJob job;
+        while (popJob(decoded, job, stats.get())) {
+            if (job.frame.size == 0 || job.repeat()) {
+                job.frame = Image(0, 0, 0);
+                pushJob(rendered, std::move(job), stats.get());
+                continue;
+            }
+            // the tree's counters go in with the time it took
+            auto analyzed = [&](const Quadtree& tree, uint64_t started) {
+                if (!stats) return;
+                stats->time(job.i, Stat::Analyze, started);
+                stats->record(job.i, Stat::Leaves, tree.leaves());
+                stats->record(job.i, Stat::Depth, tree.maxDepth());
+            };
+            uint64_t started = Stats::now();
+            if (!options.temporal) {
+                Quadtree tree = work(job.frame, options, nullptr, pool.get());
+                analyzed(tree, started);
+                started = Stats::now();
+                if (quadtrees) job.tree = std::move(tree);
+                else job.frame = tree.render(sprites, job.index, tints, nullptr, pool.get());
+                if (stats && !quadtrees) stats->time(job.i, Stat::Render, started);
+                pushJob(rendered, std::move(job), stats.get());
+                continue;
+            }
+
+            std::shared_ptr<const RenderedFrame> previous;
+            {
+                std::scoped_lock lock(historyMutex);
+                previous = history.at(job.index);
+            }
+            FrameDelta delta(job.frame, previous ? &previous->frame : nullptr);
+            std::shared_ptr<RenderedFrame> current(new RenderedFrame{job.i, {std::move(job.frame), Image(0, 0, 0), Quadtree(), {}}});
+            current->frame.tree = work(current->frame.input, options, &delta, pool.get());
+            current->frame.tiles = std::move(delta.tiles);
+            analyzed(current->frame.tree, started);
+            started = Stats::now();
+            if (quadtrees) job.tree = current->frame.tree;
+            else current->frame.output = current->frame.tree.render(sprites, job.index, tints, delta.previous ? &delta.previous->output : nullptr, pool.get());
+            if (stats && !quadtrees) stats->time(job.i, Stat::Render, started);
+            job.frame = current->frame.output;
+            {
+                std::scoped_lock lock(historyMutex);
+                if (!history[job.index] || history[job.index]->i < current->i) history[job.index] = current;
+            }
+            pushJob(rendered, std::move(job), stats.get());
+        }
+    });
+
+    Stage encode(options.encodeThreads, [&] {
+        if (stats) stats->thread("encode");
+        FrameJob job;
+        while (popJob(rendered, job, stats.get())) {
+            if (job.frame.size != 0 && !quadtrees) {
+                uint64_t started = Stats::now();
+                if (writer && !writer->encode(job.frame, job.bytes)) failed = true;
+                else if (!writer) job.frame.encode(job.bytes);
+                if (stats) stats->time(job.i, Stat::Encode, started);
+            }
+            if (job.producer) {
+                job.output->bytes = job.bytes;
+                job.output->tree = job.tree;
+                job.output->ready = true;
+            }
+            job.frame = Image(0, 0, 0);
+            pushJob(encoded, std::move(job), stats.get());
+        }
+    });
 
-    pool.wait_for_tasks();
+    // a repeat is hard linked to the file of the frame it repeats once that exists, and written out otherwise
+    auto writeFile = [&](const FrameJob& job) {
+        const std::vector<uint8_t>& bytes = job.result();
+        if (bytes.empty()) return;
+        std::string save_loc = outputName(job.i);
+        std::error_code error;
+        if (job.repeat() && job.output->written) {
+            std::filesystem::remove(save_loc, error);
+            std::filesystem::create_hard_link(outputName(job.output->i), save_loc, error);
+        }
+        bool written = true;
+        if (!job.repeat() || !job.output->written || error) {
+            uint64_t started = Stats::now();
+            written = writeOutput(job.i, bytes);
+            if (!written) unwritten++;
+            if (stats) {
+                stats->time(job.i, Stat::Write, started);
+                if (written) stats->record(job.i, Stat::BytesWritten, bytes.size());
+            }
+        }
+        // repeats only link to a file that's there, otherwise they write their own
+        if (job.producer && written) job.output->written = true;
+        options.log()<<job.i<<"\n";
+    };
+
+    Stage write(ordered ? 1 : options.writeThreads, [&] {
+        if (stats) stats->thread("write");
+        std::map<int, FrameJob> pending;
+        std::list<FrameJob> held; // repeats of frames that are still being encoded
+        int expected = start;
+        FrameJob job;
+        FrameJob last; // the last frame written to a stream, stands in for frames that couldn't be read
+        std::vector<uint8_t> black;
+        while (popJob(encoded, job, stats.get())) {
+            if (!ordered) {
+                held.push_back(std::move(job));
+                for (auto it = held.begin(); it != held.end();) {
+                    if (!it->ready()) {
+                        it++;
+                        continue;
+                    }
+                    writeFile(*it);
+                    it = held.erase(it);
+                }
+                continue;
+            }
+            pending.emplace(job.i, std::move(job));
+            for (auto it = pending.find(expected); it != pending.end() && it->second.ready(); it = pending.find(++expected)) {
+                uint64_t started = Stats::now();
+                if (quadtrees && !it->second.quadtree().nodes.empty() && !failed) {
+                    uint64_t written = quadtrees->bytesWritten;
+                    if (quadtrees->write(expected, it->second.index, it->second.quadtree())) {
+                        if (stats) {
+                            stats->time(expected, Stat::Write, started);
+                            stats->record(expected, Stat::BytesWritten, quadtrees->bytesWritten - written);
+                        }
+                        options.log()<<expected<<"\n";
+                    } else {
+                        std::cerr<<"Failed to write frame "<<expected<<" to "<<options.quadtrees<<std::endl;
+                        failed = true;
+                    }
+                } else if (writer && !failed) {
+                    // a stream keeps one frame per input frame, or its timing drifts
+                    bool placeholder = it->second.result().empty();
+                    if (placeholder && last.result().empty() && black.empty()) writer->encode(Image(writer->w, writer->h, 3), black);
+                    const std::vector<uint8_t>& bytes = !placeholder ? it->second.result() : (last.result().empty() ? black : last.result());
+                    if (placeholder) std::cerr<<"Frame "<<expected<<" couldn't be read, writing "<<(last.result().empty() ? "a black frame" : "the last frame again")<<std::endl;
+                    if (writer->write(bytes)) {
+                        if (stats) {
+                            stats->time(expected, Stat::Write, started);
+                            stats->record(expected, Stat::BytesWritten, bytes.size());
+                        }
+                        options.log()<<expected<<"\n";
+                    } else {
+                        std::cerr<<"Failed to write frame "<<expected<<" to "<<options.output<<std::endl;
+                        failed = true;
+                    }
+                    if (!placeholder) last = std::move(it->second);
+                }
+                pending.erase(it);
+                window.advance();
+            }
+        }
+        // every frame has been encoded by now
+        for (FrameJob& job : held) {
+            writeFile(job);
+        }
+    });
+
+    decode.join();
+    decoded.close();
+    quadify.join();
+    rendered.close();
+    encode.join();
+    encoded.close();
+    write.join();
+    if (writer && !writer->close() && !failed) {
+        std::cerr<<"Failed to finish writing "<<options.output<<std::endl;
+        failed = true;
+    }
+    if (quadtrees && !quadtrees->close() && !failed) {
+        std::cerr<<"Failed to finish writing "<<options.quadtrees<<std::endl;
+        failed = true;
+    }
+    if (skipped) options.log()<<"Skipped "<<skipped<<" finished frames\n";
+    if (unwritten) reportUnwritten(unwritten);
+    if (!options.stats.empty()) stats->write(options.stats);
+    if (!options.trace.empty()) stats->writeTrace(options.trace);
+    return !failed && !unwritten;
 }
 
-void workCol(int i, int index, std::vector<std::map<std::pair<int, int>, Image>>& preloadedResized) {
-    std::string frame_name("in/img_" + std::to_string(i) + ".png");
-    Image frame(frame_name.c_str());
-    Image frame_done = frame.quadifyFrameRGB(preloadedResized.at(index));
-    std::string save_loc("out/img_" + std::to_string(i) + ".png");
-    frame_done.write(save_loc.c_str());
-    std::cout<<i<<"\n";
-}
\ No newline at end of file
+// read -> draw -> write, the trees are scaled to the output size and drawn with the sprites resized to match
+// a .qts file can only be read in order, the drawing is spread over the quadify threads
+bool renderQuadtrees(const std::string& path, const Options& options) {
+    QuadtreeReader reader(path);
+    if (!reader.ok()) return false;
+    int width = options.inputWidth ? options.inputWidth : reader.w;
+    int height = options.inputHeight ? options.inputHeight : reader.h;
+
+    std::vector<std::pair<int, int>> sizes = Image::scaledSizes(Image::blockSizes(reader.w, reader.h, splitLimitsAny), reader.w, reader.h, width, height);
+    SpriteAtlas sprites = loadSprites(options, reader.sprites, sizes);
+
+    std::unique_ptr<FrameWriter> writer;
+    if (!options.output.empty()) {
+        writer.reset(new FrameWriter(options.output, options.outputFormat, width, height, options.fps));
+        if (!writer->ok()) return false;
+    }
+
+    BoundedQueue<TreeJob> decoded(options.queueSize);
+    BoundedQueue<TreeJob> drawn(options.queueSize);
+    ReorderWindow window(0, options.queueSize * 2 + 1 + options.quadifyThreads);
+    std::unique_ptr<work_stealing_pool> pool(options.frameThreads ? new work_stealing_pool(options.frameThreads) : nullptr);
+    std::unique_ptr<Stats> stats(options.stats.empty() && options.trace.empty() ? nullptr : new Stats(!options.trace.empty()));
+    std::atomic<int> unwritten(0);
+    std::atomic<bool> failed(false);
+
+    // reading a tree counts as decoding the frame
+    Stage read(1, [&] {
+        if (stats) stats->thread("read");
+        TreeJob job;
+        for (job.n = 0; !failed; job.n++) {
+            if (writer) admitJob(window, job.n, stats.get());
+            uint64_t started = Stats::now();
+            uint64_t bytesRead = reader.bytesRead;
+            if (!reader.read(job.i, job.index, job.tree)) break;
+            if (job.index >= sprites.frames()) {
+                std::cerr<<"Frame "<<job.i<<" uses sprite frame "<<job.index<<", the file only has "<<sprites.frames()<<std::endl;
+                failed = true;
+                break;
+            }
+            job.tree = job.tree.scaled(width, height);
+            if (stats) {
+                stats->time(job.i, Stat::Decode, started);
+                stats->record(job.i, Stat::BytesRead, reader.bytesRead - bytesRead);
+                stats->record(job.i, Stat::Leaves, job.tree.leaves());
+                stats->record(job.i, Stat::Depth, job.tree.maxDepth());
+            }
+            pushJob(decoded, std::move(job), stats.get());
+        }
+    });
+
+    // with --resume a finished frame goes on without bytes, the tree still had to be read for the frames after it
+    Stage draw(options.quadifyThreads, [&] {
+        if (stats) stats->thread("draw");
+        thread_local TintCache tintCache(options.tintCache);
+        TreeJob job;
+        while (popJob(decoded, job, stats.get())) {
+            job.bytes.clear();
+            if (options.resume && outputComplete(job.i)) {
+                job.tree = Quadtree();
+                pushJob(drawn, std::move(job), stats.get());
+                continue;
+            }
+            uint64_t started = Stats::now();
+            Image frame = job.tree.render(sprites, job.index, options.tintCache ? &tintCache : nullptr, nullptr, pool.get());
+            if (stats) stats->time(job.i, Stat::Render, started);
+            started = Stats::now();
+            if (writer && !writer->encode(frame, job.bytes)) failed = true;
+            else if (!writer) frame.encode(job.bytes);
+            if (stats) stats->time(job.i, Stat::Encode, started);
+            job.tree = Quadtree();
+            pushJob(drawn, std::move(job), stats.get());
+        }
+    });
+
+    Stage write(writer ? 1 : options.writeThreads, [&] {
+        if (stats) stats->thread("write");
+        std::map<int, TreeJob> pending;
+        int expected = 0;
+        TreeJob job;
+        while (popJob(drawn, job, stats.get())) {
+            if (!writer) {
+                if (job.bytes.empty()) continue;
+                uint64_t started = Stats::now();
+                bool written = writeOutput(job.i, job.bytes);
+                if (!written) unwritten++;
+                if (stats) {
+                    stats->time(job.i, Stat::Write, started);
+                    if (written) stats->record(job.i, Stat::BytesWritten, job.bytes.size());
+                }
+                options.log()<<job.i<<"\n";
+                continue;
+            }
+            pending.emplace(job.n, std::move(job));
+            for (auto it = pending.find(expected); it != pending.end(); it = pending.find(++expected)) {
+                uint64_t started = Stats::now();
+                if (!failed && writer->write(it->second.bytes)) {
+                    if (stats) {
+                        stats->time(it->second.i, Stat::Write, started);
+                        stats->record(it->second.i, Stat::BytesWritten, it->second.bytes.size());
+                    }
+                    options.log()<<it->second.i<<"\n";
+                } else if (!failed) {
+                    std::cerr<<"Failed to write frame "<<it->second.i<<" to "<<options.output<<std::endl;
+                    failed = true;
+                }
+                pending.erase(it);
+                window.advance();
+            }
+        }
+    });
+
+    read.join();
+    decoded.close();
+    draw.join();
+    drawn.close();
+    write.join();
+    if (writer && !writer->close() && !failed) {
+        std::cerr<<"Failed to finish writing "<<options.output<<std::endl;
+        failed = true;
+    }
+    if (unwritten) reportUnwritten(unwritten);
+    if (!options.stats.empty()) stats->write(options.stats);
+    if (!options.trace.empty()) stats->writeTrace(options.trace);
+    return !failed && !reader.corrupt && !unwritten;
+}
@@ -0,0 +1,626 @@
+// checks of the Image kernels, run by ctest as `quadify_tests <group>`, prints what failed and exits 1 if anything did
+// kernels: every channel count (1 gray, 2 gray + alpha, 3 RGB, 4 RGBA) against a plain reference of what the
+//          specialized kernel is meant to do, on random images
+// pools:   thread_pool in both modes and work_stealing_pool running every task once, and waits sleeping not polling
+// buffers: PixelBuffer owning, copying, moving and resizing its bytes, and the buffers it adopts
+// frames:  whole frames against what the original quadify drew for them, through every way a frame can be drawn
+//          (run from the repository root, it reads in/img_0.png and res/)
+// qts, streams, outputs: the quadify program given after the group, run in a scratch directory on a few small frames,
+//          checked by its exit status and what it left behind
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+
+#include "Image.h"
+#include "QuadtreeStream.h"
+#include "lib/thread_pool.hpp"
+
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <time.h>
+#endif
+
+static int failures = 0;
+
+static void check(bool ok, const std::string& what) {
+    if (!ok) {
+        std::cerr<<"FAILED "<<what<<std::endl;
+        failures++;
+    }
+}
+
+static Image randomImage(int w, int h, int channels, std::mt19937& random) {
+    Image img(w, h, channels);
+    for (uint8_t& value : img.data) {
+        value = random() & 0xff;
+    }
+    return img;
+}
+
+static bool samePixels(const Image& a, const Image& b) {
+    return a.w == b.w && a.h == b.h && a.channels == b.channels && std::equal(a.data.begin(), a.data.end(), b.data.begin());
+}
+
+static uint8_t* pixelAt(Image& img, int x, int y) {
+    return img.data.data() + ((size_t)y * img.w + x) * img.channels;
+}
+
+static uint8_t byteBound(float value) {
+    return (uint8_t)std::min(std::max(value, 0.f), 255.f);
+}
+
+// the float "over" of overlayPixels for one color channel
+static uint8_t blendReference(uint8_t src, float srcAlpha, uint8_t dst, float dstAlpha) {
+    float outAlpha = srcAlpha + dstAlpha * (1 - srcAlpha);
+    if (outAlpha < .01) return 0;
+    return byteBound((src/255.f * srcAlpha + dst/255.f * dstAlpha * (1 - srcAlpha)) / outAlpha * 255.f);
+}
+
+static void testColorMask(std::mt19937& random) {
+    for (int channels = 1; channels <= 4; channels++) {
+        Image img = randomImage(37, 23, channels, random);
+        Image masked = img.colorMaskNew(.25f, .5f, .75f);
+        const float tint[3] = {.25f, .5f, .75f};
+        int colors = channels < 3 ? 1 : 3;
+        bool ok = true;
+        for (size_t i = 0; i < img.data.size(); i++) {
+            int channel = i % channels;
+            uint8_t expected = channel < colors ? (uint8_t)(img.data[i] * tint[channel]) : img.data[i];
+            ok &= masked.data[i] == expected;
+        }
+        check(ok, "colorMask with " + std::to_string(channels) + " channels");
+    }
+}
+
+// a gray + alpha sprite draws like the RGBA sprite with the gray in all three colors, over every target
+static void testGrayAlphaOverlay(std::mt19937& random) {
+    Image sprite = randomImage(29, 17, 2, random);
+    // fully transparent and fully opaque pixels next to the random ones
+    for (int x = 0; x < sprite.w; x++) {
+        pixelAt(sprite, x, 0)[1] = 0;
+        pixelAt(sprite, x, 1)[1] = 255;
+    }
+
+    for (int channels = 1; channels <= 4; channels++) {
+        Image target = randomImage(40, 30, channels, random);
+        Image drawn = target;
+        int ox = -3;
+        int oy = 5;
+        drawn.overlay(sprite, ox, oy, .5f, 1, .75f);
+
+        const float tint[3] = {.5f, 1, .75f};
+        int colors = channels < 3 ? 1 : 3;
+        bool alpha = channels == 2 || channels == 4;
+        bool ok = true;
+        for (int y = 0; y < target.h; y++) {
+            for (int x = 0; x < target.w; x++) {
+                uint8_t* before = pixelAt(target, x, y);
+                uint8_t* after = pixelAt(drawn, x, y);
+                int sx = x - ox;
+                int sy = y - oy;
+                if (sx < 0 || sy < 0 || sx >= sprite.w || sy >= sprite.h) {
+                    ok &= std::equal(before, before + channels, after);
+                    continue;
+                }
+                uint8_t* src = pixelAt(sprite, sx, sy);
+                float srcAlpha = src[1] / 255.f;
+                float dstAlpha = alpha ? before[colors] / 255.f : 1;
+                bool opaque = srcAlpha > .99 && dstAlpha > .99;
+                for (int channel = 0; channel < colors; channel++) {
+                    uint8_t tinted = (uint8_t)(src[0] * tint[channel]);
+                    ok &= after[channel] == (opaque ? tinted : blendReference(tinted, srcAlpha, before[channel], dstAlpha));
+                }
+                if (alpha) {
+                    float outAlpha = srcAlpha + dstAlpha * (1 - srcAlpha);
+                    ok &= after[colors] == (opaque ? src[1] : outAlpha < .01 ? 0 : byteBound(outAlpha * 255.f));
+                }
+            }
+        }
+        check(ok, "gray + alpha sprite over " + std::to_string(channels) + " channels");
+    }
+
+    // over a gray frame it's the same as the RGBA sprite, which draws through the float path too
+    Image rgba(sprite.w, sprite.h, 4);
+    for (size_t i = 0; i < (size_t)sprite.w * sprite.h; i++) {
+        std::fill(rgba.data.begin() + i * 4, rgba.data.begin() + i * 4 + 3, sprite.data[i * 2]);
+        rgba.data[i * 4 + 3] = sprite.data[i * 2 + 1];
+    }
+    Image gray = randomImage(40, 30, 1, random);
+    Image fromGrayAlpha = gray;
+    fromGrayAlpha.overlay(sprite, 4, -2, .5f, .5f, .5f);
+    gray.overlay(rgba, 4, -2, .5f, .5f, .5f);
+    check(samePixels(fromGrayAlpha, gray), "gray + alpha and RGBA sprite over a gray frame");
+}
+
+static void testResize(std::mt19937& random) {
+    for (int channels = 1; channels <= 4; channels++) {
+        Image img = randomImage(31, 19, channels, random);
+        Image resized = img.resizeFastNew(47, 11);
+        double xRatio = img.w / 47.0;
+        double yRatio = img.h / 11.0;
+        bool ok = true;
+        for (int y = 0; y < resized.h; y++) {
+            for (int x = 0; x < resized.w; x++) {
+                uint8_t* src = pixelAt(img, (int)floor(x * xRatio), (int)floor(y * yRatio));
+                ok &= std::equal(src, src + channels, pixelAt(resized, x, y));
+            }
+        }
+        check(ok, "resizeFastNew with " + std::to_string(channels) + " channels");
+    }
+}
+
+// the direct checks, the summed-area table and the tiled table agree, and only the colors of an image count: a
+// gray + alpha image checks like its gray channel
+static void testChecks(std::mt19937& random) {
+    for (int channels = 1; channels <= 4; channels++) {
+        Image img = randomImage(45, 33, channels, random);
+        // flat blocks, so some checks come out uniform
+        for (int y = 8; y < 24; y++) {
+            for (int x = 8; x < 24; x++) {
+                std::fill(pixelAt(img, x, y), pixelAt(img, x, y) + channels, 90);
+            }
+        }
+        int colors = channels < 3 ? 1 : 3;
+        Image gray(img.w, img.h, 1);
+        for (size_t i = 0; i < (size_t)img.w * img.h; i++) {
+            gray.data[i] = img.data[i * channels];
+        }
+
+        SummedAreaTable bw(img, 1, false);
+        SummedAreaTable rgb(img, 3, true);
+        FrameDelta delta(img, nullptr, 8);
+        SummedAreaTable tiled(img, 3, true, delta);
+        SummedAreaTable grayTable(gray, 3, true);
+        bool ok = true;
+        const int blocks[][4] = { {0, 0, 45, 33}, {8, 8, 16, 16}, {10, 12, 4, 4}, {3, 5, 29, 7}, {44, 32, 1, 1} };
+        for (const auto& b : blocks) {
+            int sum = 0;
+            uint64_t sums[3] = {0, 0, 0};
+            uint64_t squares = 0;
+            bool uniform = true;
+            for (int y = b[1]; y < b[1] + b[3]; y++) {
+                for (int x = b[0]; x < b[0] + b[2]; x++) {
+                    uint8_t* pixel = pixelAt(img, x, y);
+                    sum += pixel[0];
+                    for (int channel = 0; channel < 3; channel++) {
+                        uint8_t value = pixel[channel < colors ? channel : 0];
+                        sums[channel] += value;
+                        squares += value * value;
+                        uniform &= value == pixelAt(img, b[0], b[1])[channel < colors ? channel : 0];
+                    }
+                }
+            }
+            uint64_t n = b[2] * b[3];
+            auto expected = std::make_tuple(uniform, (int)(sums[0] / n), (int)(sums[1] / n), (int)(sums[2] / n));
+
+            ok &= img.subdivideCheckBW(b[0], b[1], b[2], b[3]) == (int)(sum / n);
+            ok &= img.subdivideCheckBW(bw, b[0], b[1], b[2], b[3]) == (int)(sum / n);
+            ok &= img.subdivideCheckRGB(b[0], b[1], b[2], b[3]) == expected;
+            ok &= img.subdivideCheckRGB(rgb, b[0], b[1], b[2], b[3]) == expected;
+            ok &= img.subdivideCheckRGB(tiled, b[0], b[1], b[2], b[3]) == expected;
+            ok &= rgb.blockSumSq(b[0], b[1], b[2], b[3]) == squares;
+            if (colors == 1) ok &= gray.subdivideCheckRGB(grayTable, b[0], b[1], b[2], b[3]) == expected;
+        }
+        check(ok, "block checks with " + std::to_string(channels) + " channels");
+    }
+}
+
+static void testKernels() {
+    std::mt19937 random(1234);
+    testColorMask(random);
+    testGrayAlphaOverlay(random);
+    testResize(random);
+    testChecks(random);
+}
+
+// every index of a loop runs once, every pushed task runs before wait_for_tasks() returns
+static void testThreadPool(bool blocking) {
+    std::string mode = blocking ? "blocking thread_pool" : "polling thread_pool";
+    thread_pool pool(4, blocking);
+    check(pool.is_blocking() == blocking, mode + " mode");
+
+    std::vector<std::atomic<int>> runs(1000);
+    pool.parallelize_loop(0, 999, [&](int i) { runs[i]++; });
+    pool.parallelize_loop(0, 999, [&](int i) { runs[i]++; }, 7);
+    check(std::all_of(runs.begin(), runs.end(), [](const std::atomic<int>& count) { return count == 2; }), mode + " runs every index of a loop once");
+
+    std::atomic<int> done(0);
+    for (int i = 0; i < 100; i++) {
+        pool.push_task([&done] { done++; });
+    }
+    pool.wait_for_tasks();
+    check(done == 100, mode + " waits for every task");
+    check(pool.submit([] { return 42; }).get() == 42, mode + " submit");
+
+    if (!blocking) return;
+    // polling would sleep sleep_duration (10 ms) after each of these loops, at least a second for all of them
+    pool.sleep_duration = 10000;
+    auto started = std::chrono::steady_clock::now();
+    for (int loop = 0; loop < 100; loop++) {
+        pool.parallelize_loop(0, 3, [&](int i) { runs[i]++; });
+        pool.push_task([&done] { done++; });
+        pool.wait_for_tasks();
+    }
+    check(std::chrono::steady_clock::now() - started < std::chrono::milliseconds(500), mode + " wakes the caller when a loop or the tasks are done");
+}
+
+// every index of a loop runs once, also from loops inside its tasks, and the caller sleeps while the last blocks run
+static void testWorkStealingPool() {
+    work_stealing_pool pool(4);
+    std::vector<std::atomic<int>> runs(1000);
+    pool.parallelize_loop(0, 999, [&](int i) { runs[i]++; });
+    pool.parallelize_loop(0, 9, [&](int outer) { pool.parallelize_loop(outer * 100, outer * 100 + 99, [&](int i) { runs[i]++; }, 4); }, 10);
+    check(std::all_of(runs.begin(), runs.end(), [](const std::atomic<int>& count) { return count == 2; }), "work_stealing_pool runs every index of a nested loop once");
+
+#ifndef _WIN32
+    // only the workers' blocks take 200 ms, spinning on run_pending_task() for them would take most of that in thread time
+    std::thread::id caller = std::this_thread::get_id();
+    timespec before, after;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &before);
+    pool.parallelize_loop(0, 7, [caller](int) {
+        if (std::this_thread::get_id() != caller) std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }, 8);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &after);
+    double busy = (after.tv_sec - before.tv_sec) + (after.tv_nsec - before.tv_nsec) / 1e9;
+    check(busy < 0.05, "work_stealing_pool caller sleeps until its loop is done");
+#endif
+}
+
+static void testPools() {
+    testThreadPool(false);
+    testThreadPool(true);
+    testWorkStealingPool();
+}
+
+static int released = 0;
+
+static void countRelease(void* pixels) {
+    released++;
+    free(pixels);
+}
+
+static void testBuffers() {
+    PixelBuffer zeroed(100);
+    check(zeroed.size() == 100 && std::all_of(zeroed.begin(), zeroed.end(), [](uint8_t value) { return value == 0; }), "a new buffer is zeroed");
+
+    // an adopted buffer is freed once with its own function, by whichever buffer ends up with it
+    uint8_t* pixels = (uint8_t*)malloc(16);
+    for (int i = 0; i < 16; i++) {
+        pixels[i] = i + 1;
+    }
+    {
+        PixelBuffer adopted(pixels, 16, countRelease);
+        check(adopted.data() == pixels && adopted.size() == 16, "adopting keeps the pixels where they are");
+
+        PixelBuffer copy = adopted;
+        copy[0] = 99;
+        check(copy.data() != pixels && adopted[0] == 1 && std::equal(copy.begin() + 1, copy.end(), adopted.begin() + 1), "copies are deep");
+
+        PixelBuffer moved = std::move(adopted);
+        check(moved.data() == pixels && adopted.empty(), "moving hands the pixels over");
+
+        moved.resize(20);
+        check(moved.size() == 20 && moved[15] == 16 && moved[19] == 0 && released == 1, "growing keeps the bytes and frees the adopted buffer");
+        moved.resize(4);
+        check(moved.size() == 4 && moved[3] == 4, "shrinking keeps the leading bytes");
+    }
+    check(released == 1, "an adopted buffer is released once");
+
+    {
+        PixelBuffer adopted((uint8_t*)malloc(8), 8, countRelease);
+    }
+    check(released == 2, "an adopted buffer is released when the buffer goes");
+
+    // a read image owns stb's buffer, copies of it don't
+    Image photo("in/img_0.png");
+    Image copy = photo;
+    check(photo.size != 0 && photo.data.size() == photo.size && copy.data.data() != photo.data.data() && samePixels(photo, copy), "reading and copying in/img_0.png");
+}
+
+// the pattern of quadify_bench, with an alpha that fades out towards the right on every other square for RGBA
+static Image syntheticFrame(int w, int h, int channels) {
+    Image frame(w, h, channels);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            uint8_t* pixel = pixelAt(frame, x, y);
+            int dx = x - w / 2;
+            int dy = y - h / 2;
+            bool disc = dx * dx + dy * dy < h * h / 9;
+            bool check = (x * 24 / w + y * 16 / h) % 2;
+            pixel[0] = disc ? 255 : x * 255 / w;
+            pixel[1] = disc ? 255 : y * 255 / h;
+            pixel[2] = check ? 200 : 40;
+            if (channels == 4) pixel[3] = check ? 255 : 255 - x * 255 / w;
+        }
+    }
+    return frame;
+}
+
+// one frame drawn with sprite frame 0 the plain way, then every other way, which all have to give the same pixels
+static void testFrame(const std::string& name, Image frame, bool bw, uint64_t golden, const std::vector<Image>& sprites) {
+    auto analyze = [&](Image& img, Analysis analysis, FrameDelta* delta, work_stealing_pool* pool) {
+        return bw ? img.analyzeBW(analysis, delta, pool) : img.analyzeRGB(analysis, delta, pool);
+    };
+    SpriteAtlas atlas;
+    {
+        thread_pool atlasPool;
+        atlas = SpriteAtlas(sprites, Image::blockSizes(frame.w, frame.h, bw ? splitLimitsBW : splitLimitsRGB), atlasPool);
+    }
+
+    Quadtree tree = analyze(frame, Analysis::Integral, nullptr, nullptr);
+    Image drawn = tree.render(atlas, 0);
+    check(drawn.hash() == golden, name + " against the original output");
+    auto same = [&](const Image& other, const std::string& what) {
+        check(samePixels(drawn, other), name + " " + what);
+    };
+
+    same(analyze(frame, Analysis::Pyramid, nullptr, nullptr).render(atlas, 0), "from the block pyramid");
+    {
+        work_stealing_pool pool(4);
+        same(analyze(frame, Analysis::Integral, nullptr, &pool).render(atlas, 0, nullptr, nullptr, &pool), "split over a pool");
+        same(analyze(frame, Analysis::Pyramid, nullptr, &pool).render(atlas, 0, nullptr, nullptr, &pool), "from the block pyramid split over a pool");
+    }
+    TintCache tints(64);
+    same(tree.render(atlas, 0, &tints), "with the tint cache");
+    {
+        std::string cache = (std::filesystem::temp_directory_path() / "quadify_tests.atlas").string();
+        SpriteAtlas cached;
+        check(atlas.save(cache) && cached.load(cache), name + " atlas through " + cache);
+        same(tree.render(cached, 0), "from the cached atlas");
+    }
+
+    // the same frame again reuses all of the first one, a frame with a changed block reuses the rest
+    FrameDelta firstDelta(frame, nullptr);
+    QuadifiedFrame first{frame, Image(0, 0, 0), analyze(frame, Analysis::Integral, &firstDelta, nullptr), {}};
+    first.output = first.tree.render(atlas, 0);
+    first.tiles = std::move(firstDelta.tiles);
+    same(first.output, "as the first frame of a temporal run");
+    FrameDelta repeatDelta(frame, &first);
+    same(analyze(frame, Analysis::Integral, &repeatDelta, nullptr).render(atlas, 0, nullptr, &first.output), "repeated in a temporal run");
+
+    Image changed = frame;
+    changed.rect(frame.w / 3, frame.h / 4, frame.w / 5, frame.h / 6, 30, 160, 90);
+    Image changedDrawn = analyze(changed, Analysis::Integral, nullptr, nullptr).render(atlas, 0);
+    FrameDelta changedDelta(changed, &first);
+    Image changedReused = analyze(changed, Analysis::Integral, &changedDelta, nullptr).render(atlas, 0, nullptr, &first.output);
+    check(samePixels(changedDrawn, changedReused), name + " changed in a temporal run");
+
+    // through a .qts file and back
+    std::string path = (std::filesystem::temp_directory_path() / "quadify_tests.qts").string();
+    {
+        QuadtreeWriter writer(path, frame.w, frame.h, (int)sprites.size());
+        check(writer.ok() && writer.write(0, 0, tree) && writer.close(), name + " written to " + path);
+    }
+    {
+        QuadtreeReader reader(path);
+        int i = -1;
+        int index = -1;
+        Quadtree read;
+        bool ok = reader.ok() && reader.read(i, index, read) && i == 0 && index == 0;
+        check(ok, name + " read back from " + path);
+        if (ok) same(read.render(atlas, 0), "through a .qts file");
+    }
+    std::error_code error;
+    std::filesystem::remove(path, error);
+}
+
+// Image::hash() of what quadify wrote for these frames before the summed-area tables and everything after them
+// (the first commit of this repository, "BW 0 0" / "Col 0 0" with the frame as in/img_0.png)
+static void testFrames() {
+    std::vector<Image> sprites;
+    for (int i = 0; i < 6; i++) {
+        sprites.emplace_back(("res/" + std::to_string(i) + ".png").c_str());
+    }
+    Image photo("in/img_0.png");
+    if (photo.size == 0 || sprites.back().size == 0) {
+        check(false, "loading in/img_0.png and res/, run from the repository root");
+        return;
+    }
+
+    testFrame("in/img_0.png BW", photo, true, 0x8b4882000b8ea339ull, sprites);
+    testFrame("RGB BW", syntheticFrame(640, 360, 3), true, 0xe0d3231718afba68ull, sprites);
+    testFrame("RGB Col", syntheticFrame(640, 360, 3), false, 0x7df37903cd9c3efdull, sprites);
+    testFrame("RGBA BW", syntheticFrame(640, 360, 4), true, 0xe0d3231718afba68ull, sprites);
+    testFrame("RGBA Col", syntheticFrame(640, 360, 4), false, 0x7df37903cd9c3efdull, sprites);
+}
+
+static std::string quadify; // the program the command line groups run
+static std::filesystem::path sprites; // res/ of the repository
+
+// a fresh directory with in/img_0.png - in/img_3.png (frame 1 repeats frame 0) and an empty out/
+static std::filesystem::path scratch(const std::string& name) {
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / ("quadify_tests_" + name);
+    std::error_code error;
+    std::filesystem::remove_all(dir, error);
+    std::filesystem::create_directories(dir / "in");
+    std::filesystem::create_directories(dir / "out");
+    for (int i = 0; i < 4; i++) {
+        Image frame = syntheticFrame(160, 120, 3);
+        if (i > 1) frame.rect(i * 20, 30, 40, 50, 200, 20, 90);
+        frame.write((dir / "in" / ("img_" + std::to_string(i) + ".png")).string().c_str());
+    }
+    return dir;
+}
+
+// quadify run in dir with its output in dir/quadify.log, the exit status (128 + the signal if it was killed)
+static int run(const std::filesystem::path& dir, const std::string& args) {
+    if (quadify.empty()) return -1;
+    std::filesystem::path previous = std::filesystem::current_path();
+    std::filesystem::current_path(dir);
+    std::string command = "\"" + quadify + "\" " + args + " --sprites \"" + sprites.string() + "\" > quadify.log 2>&1";
+    int status = std::system(command.c_str());
+    std::filesystem::current_path(previous);
+#ifndef _WIN32
+    if (status != -1) status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+#endif
+    return status;
+}
+
+// checks the exit status, with the log when it isn't the expected one
+static void expectRun(const std::filesystem::path& dir, const std::string& args, int expected, const std::string& what) {
+    int status = run(dir, args);
+    if (status != expected) {
+        std::ifstream log(dir / "quadify.log");
+        std::cerr<<"quadify "<<args<<" exited with "<<status<<" instead of "<<expected<<":\n"<<log.rdbuf()<<std::endl;
+    }
+    check(status == expected, what);
+}
+
+static bool sameFiles(const std::filesystem::path& a, const std::filesystem::path& b) {
+    Image first(a.string().c_str());
+    Image second(b.string().c_str());
+    return first.size != 0 && samePixels(first, second);
+}
+
+// PNGs of frames 0 - 3 written the plain way, kept in dir/expected
+static void expectedOutputs(const std::filesystem::path& dir, const std::string& mode) {
+    expectRun(dir, mode + " 0 3", 0, mode + " writes PNGs");
+    std::filesystem::rename(dir / "out", dir / "expected");
+    std::filesystem::create_directories(dir / "out");
+}
+
+static bool sameOutputs(const std::filesystem::path& dir) {
+    bool same = true;
+    for (int i = 0; i < 4; i++) {
+        std::string name = "img_" + std::to_string(i) + ".png";
+        same &= sameFiles(dir / "expected" / name, dir / "out" / name);
+    }
+    return same;
+}
+
+// BW and Col written as .qts and drawn again give the same PNGs, a cut off file draws what it has and fails
+static void testQts() {
+    std::filesystem::path dir = scratch("qts");
+    for (std::string mode : {"BW", "Col"}) {
+        expectedOutputs(dir, mode);
+        expectRun(dir, mode + " 0 3 --qts t.qts", 0, mode + " writes t.qts");
+        check(std::filesystem::is_empty(dir / "out"), mode + " --qts writes no PNGs");
+        expectRun(dir, "Render t.qts", 0, "Render draws t.qts");
+        check(sameOutputs(dir), mode + " drawn from t.qts");
+        std::filesystem::remove_all(dir / "expected");
+        std::filesystem::remove_all(dir / "out");
+        std::filesystem::create_directories(dir / "out");
+    }
+
+    std::filesystem::resize_file(dir / "t.qts", std::filesystem::file_size(dir / "t.qts") - 10);
+    expectRun(dir, "Render t.qts", 1, "Render fails on a truncated .qts");
+
+    // a frame after a good one uses a sprite frame the file doesn't have
+    Image frame = syntheticFrame(160, 120, 3);
+    Quadtree tree = frame.analyzeBW();
+    {
+        QuadtreeWriter writer((dir / "bad.qts").string(), frame.w, frame.h, 6);
+        check(writer.write(0, 0, tree) && writer.write(1, 6, tree) && writer.close(), "writing bad.qts");
+    }
+    expectRun(dir, "Render bad.qts", 1, "Render fails on a sprite frame the .qts doesn't have");
+}
+
+// frames through a y4m file and back, and raw rgb24 out
+static void testStreams() {
+    std::filesystem::path dir = scratch("streams");
+    expectRun(dir, "Col 0 3 --output s.y4m", 0, "Col writes a y4m stream");
+    std::ifstream stream(dir / "s.y4m", std::ios::binary);
+    std::string header;
+    std::getline(stream, header);
+    check(header.rfind("YUV4MPEG2 W160 H120 ", 0) == 0, "the y4m header has the frame size");
+
+    expectRun(dir, "BW 0 -1 --input s.y4m --output t.y4m", 0, "BW reads the y4m stream until it ends");
+    check(std::filesystem::file_size(dir / "t.y4m") == std::filesystem::file_size(dir / "s.y4m"), "a y4m stream keeps every frame");
+
+    expectRun(dir, "Col 0 3 --output s.rgb --output-format rgb24", 0, "Col writes an rgb24 stream");
+    check(std::filesystem::file_size(dir / "s.rgb") == 4 * 160 * 120 * 3, "an rgb24 stream has every frame");
+
+    // headers that are refused before anything is allocated for a frame
+    const char* headers[] = {
+        "YUV4MPEG2 Wabc H120 F25:1 C444",
+        "YUV4MPEG2 W160 H12x F25:1 C444",
+        "YUV4MPEG2 W99999999 H99999 F25:1 C444",
+        "YUV4MPEG2 W65535 H65535 F25:1 C444",
+        "YUV4MPEG2 W0 H120 F25:1 C444",
+        "YUV4MPEG2 H120 F25:1 C444",
+        "YUV4MPEG2 W160 H120 F25:1 C420p10",
+    };
+    for (const char* header : headers) {
+        std::ofstream(dir / "bad.y4m", std::ios::binary)<<header<<"\nFRAME\n";
+        expectRun(dir, "Col 0 -1 --input bad.y4m", 1, std::string("Col refuses ") + header);
+    }
+    expectRun(dir, "Col 0 -1 --input s.rgb --input-format rgb24 --size 99999x99999", 1, "Col refuses a raw stream of 99999x99999");
+
+#ifdef __linux__
+    expectRun(dir, "Col 0 3 --output /dev/full", 1, "Col fails when the y4m header can't be written");
+#endif
+    // the stream's size comes from frame 0, frame 3 doesn't fit it
+    syntheticFrame(120, 160, 3).write((dir / "in" / "img_3.png").string().c_str());
+    for (std::string args : {"Col 0 3 --output u.y4m", "Col 0 3 --output u.rgb --output-format rgb24", "Col 0 3 --qts u.qts"}) {
+        expectRun(dir, args, 1, args + " fails on a frame of another size");
+    }
+}
+
+// PNGs with repeats linked, and --resume redoing only what's missing
+static void testOutputs() {
+    std::filesystem::path dir = scratch("outputs");
+    expectedOutputs(dir, "Col");
+    expectRun(dir, "Col 0 3 --dedupe 4", 0, "Col with --dedupe");
+    check(sameOutputs(dir), "Col with --dedupe writes the same PNGs");
+
+    std::filesystem::remove(dir / "out" / "img_2.png");
+    std::ofstream(dir / "out" / "img_2.png.tmp")<<"half a frame";
+    std::ofstream(dir / "out" / "img_7.png.tmp")<<"half a frame";
+    expectRun(dir, "Col 0 3 --resume", 0, "Col with --resume");
+    check(sameOutputs(dir), "--resume writes the missing frame");
+    check(!std::filesystem::exists(dir / "out" / "img_2.png.tmp") && !std::filesystem::exists(dir / "out" / "img_7.png.tmp"), "--resume removes stale .tmp files");
+
+    // a directory in the way of frame 2's .tmp file, the run goes on with the other frames and fails
+    expectRun(dir, "Col 0 3 --qts t.qts", 0, "Col writes t.qts");
+    for (std::string args : {"Col 0 3", "Render t.qts"}) {
+        std::filesystem::remove_all(dir / "out");
+        std::filesystem::create_directories(dir / "out" / "img_2.png.tmp");
+        expectRun(dir, args, 1, args + " fails when a PNG can't be written");
+        check(!std::filesystem::exists(dir / "out" / "img_2.png"), args + " leaves the frame it couldn't write out");
+        check(sameFiles(dir / "expected" / "img_3.png", dir / "out" / "img_3.png"), args + " writes the other frames");
+    }
+
+    // frame 1 repeats frame 0, which can't be written, so it gets a file of its own
+    std::filesystem::remove_all(dir / "out");
+    std::filesystem::create_directories(dir / "out" / "img_0.png.tmp");
+    expectRun(dir, "Col 0 3 --dedupe 4", 1, "Col with --dedupe fails when a PNG can't be written");
+    check(!std::filesystem::exists(dir / "out" / "img_0.png") && sameFiles(dir / "expected" / "img_1.png", dir / "out" / "img_1.png"), "a repeat of a frame that couldn't be written is written");
+}
+
+int main(int argc, char** argv) {
+    const std::map<std::string, std::function<void()>> groups = {
+        { "kernels", testKernels },
+        { "pools", testPools },
+        { "buffers", testBuffers },
+        { "frames", testFrames },
+        { "qts", testQts },
+        { "streams", testStreams },
+        { "outputs", testOutputs },
+    };
+
+    if (argc < 2 || argc > 3 || groups.count(argv[1]) == 0) {
+        std::cerr<<"Usage: quadify_tests <group> (path to quadify, for qts / streams / outputs), groups:";
+        for (const auto& [name, group] : groups) {
+            std::cerr<<" "<<name;
+        }
+        std::cerr<<std::endl;
+        return 1;
+    }
+    if (argc == 3) quadify = std::filesystem::absolute(argv[2]).string();
+    sprites = std::filesystem::absolute("res");
+
+    groups.at(argv[1])();
+    if (failures) {
+        std::cerr<<failures<<" failed"<<std::endl;
+        return 1;
+    }
+    return 0;
+}